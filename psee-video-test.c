@@ -0,0 +1,845 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * KUnit tests and micro-benchmarks for the psee-video hot paths
+ *
+ * Copyright (C) Prophesee S.A.
+ *
+ * Included at the end of psee-video.c when built with KUNIT=1 on 6.0 or
+ * later, so that the static functions can be exercised directly. No camera
+ * is needed: the "output" channel is a mock dmaengine channel whose
+ * descriptors are completed by the tests, the regbank is plain memory and
+ * vb2 buffers are set up by hand with a mock memory allocator.
+ */
+
+#include <kunit/test.h>
+#include <linux/vmalloc.h>
+
+#define TEST_BUFFERS 8
+#define TEST_REGBANK_SIZE 0x00210000
+#define TEST_BENCH_LOOPS 10000
+
+#define MOCK_DESCS 256
+
+struct mock_desc {
+	struct dma_async_tx_descriptor tx;
+	size_t len;
+	enum dma_status status;
+	u32 residue;
+	bool active;
+};
+
+/*
+ * Minimal dmaengine channel: descriptors complete in submission order when
+ * the test calls mock_complete(), which also runs their callback as the
+ * interrupt handler would.
+ */
+struct mock_dma {
+	struct dma_device device;
+	struct dma_chan chan;
+	struct mock_desc descs[MOCK_DESCS];
+	dma_cookie_t last_cookie;
+	dma_cookie_t next_complete;
+	unsigned int preps;
+	unsigned int fail_preps;
+	unsigned int interrupts;
+	unsigned int terminated;
+};
+
+static inline struct mock_dma *to_mock_dma(struct dma_chan *chan)
+{
+	return container_of(chan, struct mock_dma, chan);
+}
+
+static inline struct mock_desc *mock_cookie_desc(struct mock_dma *mock,
+						 dma_cookie_t cookie)
+{
+	return &mock->descs[cookie % MOCK_DESCS];
+}
+
+static dma_cookie_t mock_tx_submit(struct dma_async_tx_descriptor *tx)
+{
+	struct mock_dma *mock = to_mock_dma(tx->chan);
+
+	tx->cookie = ++mock->last_cookie;
+	return tx->cookie;
+}
+
+static struct dma_async_tx_descriptor *mock_prep(struct mock_dma *mock,
+						 size_t len,
+						 unsigned long flags)
+{
+	struct mock_desc *d = mock_cookie_desc(mock, mock->last_cookie + 1);
+
+	if (mock->fail_preps) {
+		mock->fail_preps--;
+		return NULL;
+	}
+
+	memset(d, 0, sizeof(*d));
+	dma_async_tx_descriptor_init(&d->tx, &mock->chan);
+	d->tx.tx_submit = mock_tx_submit;
+	d->tx.flags = flags;
+	d->len = len;
+	d->residue = len;
+	d->status = DMA_IN_PROGRESS;
+	d->active = true;
+	mock->preps++;
+
+	return &d->tx;
+}
+
+static struct dma_async_tx_descriptor *
+mock_prep_slave_sg(struct dma_chan *chan, struct scatterlist *sgl,
+		   unsigned int sg_len, enum dma_transfer_direction dir,
+		   unsigned long flags, void *context)
+{
+	return mock_prep(to_mock_dma(chan), sg_dma_len(sgl), flags);
+}
+
+static struct dma_async_tx_descriptor *
+mock_prep_dma_cyclic(struct dma_chan *chan, dma_addr_t buf_addr,
+		     size_t buf_len, size_t period_len,
+		     enum dma_transfer_direction dir, unsigned long flags)
+{
+	return mock_prep(to_mock_dma(chan), buf_len, flags);
+}
+
+static void mock_issue_pending(struct dma_chan *chan)
+{
+}
+
+static enum dma_status mock_tx_status(struct dma_chan *chan,
+				      dma_cookie_t cookie,
+				      struct dma_tx_state *txstate)
+{
+	struct mock_desc *d = mock_cookie_desc(to_mock_dma(chan), cookie);
+
+	if (d->tx.cookie != cookie || !d->active) {
+		if (txstate)
+			txstate->residue = 0;
+		return DMA_COMPLETE;
+	}
+
+	if (txstate)
+		txstate->residue = d->residue;
+	return d->status;
+}
+
+static int mock_terminate_all(struct dma_chan *chan)
+{
+	struct mock_dma *mock = to_mock_dma(chan);
+	unsigned int i;
+
+	for (i = 0; i < MOCK_DESCS; i++)
+		mock->descs[i].active = false;
+	mock->next_complete = mock->last_cookie + 1;
+	mock->terminated++;
+
+	return 0;
+}
+
+static void mock_init(struct mock_dma *mock)
+{
+	mock->device.device_prep_slave_sg = mock_prep_slave_sg;
+	mock->device.device_prep_dma_cyclic = mock_prep_dma_cyclic;
+	mock->device.device_issue_pending = mock_issue_pending;
+	mock->device.device_tx_status = mock_tx_status;
+	mock->device.device_terminate_all = mock_terminate_all;
+	mock->chan.device = &mock->device;
+	mock->next_complete = 1;
+}
+
+/* Complete the oldest in-flight descriptor, returns false if there is none */
+static bool mock_complete(struct mock_dma *mock, enum dma_status status,
+			  u32 residue)
+{
+	struct mock_desc *d = NULL;
+
+	for (; mock->next_complete <= mock->last_cookie; mock->next_complete++) {
+		d = mock_cookie_desc(mock, mock->next_complete);
+		if (d->active && d->status == DMA_IN_PROGRESS)
+			break;
+	}
+	if (mock->next_complete > mock->last_cookie)
+		return false;
+
+	d->status = status;
+	d->residue = residue;
+	if (d->tx.flags & DMA_PREP_INTERRUPT)
+		mock->interrupts++;
+	if (d->tx.callback)
+		d->tx.callback(d->tx.callback_param);
+
+	return true;
+}
+
+static void *mock_mem_cookie(struct vb2_buffer *vb, void *buf_priv)
+{
+	return buf_priv;
+}
+
+static const struct vb2_mem_ops mock_mem_ops = {
+	.cookie = mock_mem_cookie,
+};
+
+struct psee_test {
+	struct psee_video *pdata;
+	struct mock_dma *dma;
+	struct psee_buffer *bufs[TEST_BUFFERS];
+	dma_addr_t addrs[TEST_BUFFERS];
+	unsigned int saved_coalesce;
+	unsigned int saved_coalesce_us;
+};
+
+/* Make a hand-made buffer visible to vb2_get_buffer(), as REQBUFS would */
+static void test_add_buffer(struct kunit *test, struct vb2_queue *q,
+			    struct vb2_buffer *vb)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 8, 0)
+	q->bufs[vb->index] = vb;
+	q->num_buffers++;
+#else
+	if (!q->bufs) {
+		q->max_num_buffers = VB2_MAX_FRAME;
+		q->bufs = kunit_kcalloc(test, q->max_num_buffers,
+					sizeof(*q->bufs), GFP_KERNEL);
+		KUNIT_ASSERT_NOT_ERR_OR_NULL(test, q->bufs);
+		q->bufs_bitmap = kunit_kcalloc(test,
+					       BITS_TO_LONGS(q->max_num_buffers),
+					       sizeof(*q->bufs_bitmap), GFP_KERNEL);
+		KUNIT_ASSERT_NOT_ERR_OR_NULL(test, q->bufs_bitmap);
+	}
+	q->bufs[vb->index] = vb;
+	set_bit(vb->index, q->bufs_bitmap);
+#endif
+}
+
+static int psee_test_init(struct kunit *test)
+{
+	struct psee_test *t;
+	struct psee_video *pdata;
+	struct vb2_queue *q;
+	struct vb2_buffer *vb;
+	unsigned int i;
+
+	t = kunit_kzalloc(test, sizeof(*t), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, t);
+	t->dma = kunit_kzalloc(test, sizeof(*t->dma), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, t->dma);
+	t->pdata = kunit_kzalloc(test, sizeof(*t->pdata), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, t->pdata);
+	pdata = t->pdata;
+
+	pdata->regmap = (void __iomem *)vzalloc(TEST_REGBANK_SIZE);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, (void __force *)pdata->regmap);
+
+	mock_init(t->dma);
+	pdata->chan[OUT] = &t->dma->chan;
+
+	/* same as psee_video_probe() */
+	mutex_init(&pdata->lock);
+	INIT_LIST_HEAD(&pdata->buffers);
+	INIT_LIST_HEAD(&pdata->parked);
+	INIT_LIST_HEAD(&pdata->taps);
+	spin_lock_init(&pdata->qlock);
+	INIT_WORK(&pdata->recovery_work, recovery_work);
+	mutex_init(&pdata->ring.lock);
+	init_waitqueue_head(&pdata->ring.wait);
+	hrtimer_init(&pdata->coalesce_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+	pdata->coalesce_timer.function = coalesce_timer;
+	spin_lock_init(&pdata->vdev.fh_lock);
+	INIT_LIST_HEAD(&pdata->vdev.fh_list);
+
+	q = &pdata->queue;
+	q->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	q->drv_priv = pdata;
+	q->mem_ops = &mock_mem_ops;
+	q->ops = &psee_qops;
+	q->memory = VB2_MEMORY_MMAP;
+	INIT_LIST_HEAD(&q->done_list);
+	spin_lock_init(&q->done_lock);
+	init_waitqueue_head(&q->done_wq);
+
+	for (i = 0; i < TEST_BUFFERS; i++) {
+		t->bufs[i] = kunit_kzalloc(test, sizeof(*t->bufs[i]), GFP_KERNEL);
+		KUNIT_ASSERT_NOT_ERR_OR_NULL(test, t->bufs[i]);
+		t->addrs[i] = 0x10000000 + i * SIZE_IMAGE;
+
+		vb = &t->bufs[i]->vb.vb2_buf;
+		vb->vb2_queue = q;
+		vb->index = i;
+		vb->memory = VB2_MEMORY_MMAP;
+		vb->num_planes = 1;
+		vb->planes[0].length = SIZE_IMAGE;
+		vb->planes[0].mem_priv = &t->addrs[i];
+		vb->state = VB2_BUF_STATE_DEQUEUED;
+		buf_init(vb);
+		test_add_buffer(test, q, vb);
+	}
+
+	t->saved_coalesce = irq_coalesce;
+	t->saved_coalesce_us = irq_coalesce_us;
+	irq_coalesce = 1;
+
+	test->priv = t;
+	return 0;
+}
+
+static void psee_test_exit(struct kunit *test)
+{
+	struct psee_test *t = test->priv;
+
+	hrtimer_cancel(&t->pdata->coalesce_timer);
+	cancel_work_sync(&t->pdata->recovery_work);
+	vfree((void __force *)t->pdata->regmap);
+	irq_coalesce = t->saved_coalesce;
+	irq_coalesce_us = t->saved_coalesce_us;
+}
+
+/* Hand a buffer to the driver, as vb2 does on QBUF while streaming */
+static void test_queue(struct psee_test *t, unsigned int i)
+{
+	struct vb2_buffer *vb = &t->bufs[i]->vb.vb2_buf;
+
+	vb->state = VB2_BUF_STATE_ACTIVE;
+	atomic_inc(&t->pdata->queue.owned_by_drv_count);
+	buffer_queue(vb);
+}
+
+/* Take a done buffer back from vb2, as DQBUF does */
+static void test_dequeue(struct psee_test *t, unsigned int i)
+{
+	struct vb2_buffer *vb = &t->bufs[i]->vb.vb2_buf;
+
+	list_del(&vb->done_entry);
+	vb->state = VB2_BUF_STATE_DEQUEUED;
+}
+
+static int test_state(struct psee_test *t, unsigned int i)
+{
+	return t->bufs[i]->vb.vb2_buf.state;
+}
+
+static void psee_test_queue_order(struct kunit *test)
+{
+	struct psee_test *t = test->priv;
+	struct mock_desc *d;
+	unsigned int i;
+
+	for (i = 0; i < 4; i++)
+		test_queue(t, i);
+
+	KUNIT_EXPECT_EQ(test, t->dma->preps, 4u);
+	for (i = 0; i < 4; i++) {
+		d = mock_cookie_desc(t->dma, t->bufs[i]->dma_cookie);
+		KUNIT_EXPECT_EQ(test, t->bufs[i]->dma_cookie, (dma_cookie_t)(i + 1));
+		KUNIT_EXPECT_EQ(test, d->len, (size_t)SIZE_IMAGE);
+		KUNIT_EXPECT_TRUE(test, d->tx.flags & DMA_PREP_INTERRUPT);
+	}
+
+	KUNIT_EXPECT_TRUE(test, mock_complete(t->dma, DMA_COMPLETE, 0));
+	KUNIT_EXPECT_TRUE(test, mock_complete(t->dma, DMA_COMPLETE, 0));
+
+	KUNIT_EXPECT_EQ(test, test_state(t, 0), VB2_BUF_STATE_DONE);
+	KUNIT_EXPECT_EQ(test, test_state(t, 1), VB2_BUF_STATE_DONE);
+	KUNIT_EXPECT_EQ(test, test_state(t, 2), VB2_BUF_STATE_ACTIVE);
+	KUNIT_EXPECT_EQ(test, t->bufs[0]->vb.sequence, 0u);
+	KUNIT_EXPECT_EQ(test, t->bufs[1]->vb.sequence, 1u);
+	KUNIT_EXPECT_PTR_EQ(test, list_first_entry(&t->pdata->queue.done_list,
+						   struct vb2_buffer, done_entry),
+			    &t->bufs[0]->vb.vb2_buf);
+	KUNIT_EXPECT_PTR_EQ(test, list_first_entry(&t->pdata->buffers,
+						   struct psee_buffer, list),
+			    t->bufs[2]);
+}
+
+/* A completion callback never retires a buffer ahead of an older one */
+static void psee_test_in_order_retire(struct kunit *test)
+{
+	struct psee_test *t = test->priv;
+	struct mock_desc *d;
+
+	test_queue(t, 0);
+	test_queue(t, 1);
+
+	/* the second descriptor finishes first */
+	d = mock_cookie_desc(t->dma, t->bufs[1]->dma_cookie);
+	d->status = DMA_COMPLETE;
+	d->residue = 0;
+	d->tx.callback(d->tx.callback_param);
+
+	KUNIT_EXPECT_EQ(test, test_state(t, 0), VB2_BUF_STATE_ACTIVE);
+	KUNIT_EXPECT_EQ(test, test_state(t, 1), VB2_BUF_STATE_ACTIVE);
+
+	KUNIT_EXPECT_TRUE(test, mock_complete(t->dma, DMA_COMPLETE, 0));
+	KUNIT_EXPECT_EQ(test, test_state(t, 0), VB2_BUF_STATE_DONE);
+	KUNIT_EXPECT_EQ(test, test_state(t, 1), VB2_BUF_STATE_DONE);
+	KUNIT_EXPECT_EQ(test, t->bufs[1]->vb.sequence, 1u);
+	KUNIT_EXPECT_TRUE(test, list_empty(&t->pdata->buffers));
+}
+
+static void psee_test_payload(struct kunit *test)
+{
+	struct psee_test *t = test->priv;
+
+	test_queue(t, 0);
+	test_queue(t, 1);
+	test_queue(t, 2);
+
+	mock_complete(t->dma, DMA_COMPLETE, 0);
+	mock_complete(t->dma, DMA_COMPLETE, SIZE_IMAGE - 100);
+	mock_complete(t->dma, DMA_COMPLETE, SIZE_IMAGE);
+
+	KUNIT_EXPECT_EQ(test, vb2_get_plane_payload(&t->bufs[0]->vb.vb2_buf, 0),
+			(unsigned long)SIZE_IMAGE);
+	KUNIT_EXPECT_EQ(test, vb2_get_plane_payload(&t->bufs[1]->vb.vb2_buf, 0),
+			100ul);
+	KUNIT_EXPECT_EQ(test, vb2_get_plane_payload(&t->bufs[2]->vb.vb2_buf, 0),
+			0ul);
+}
+
+static void psee_test_error_recovery(struct kunit *test)
+{
+	struct psee_test *t = test->priv;
+	struct psee_video *pdata = t->pdata;
+	unsigned int i;
+
+	pdata->streaming = true;
+	for (i = 0; i < 4; i++)
+		test_queue(t, i);
+
+	KUNIT_EXPECT_TRUE(test, mock_complete(t->dma, DMA_ERROR, 0));
+	KUNIT_EXPECT_EQ(test, test_state(t, 0), VB2_BUF_STATE_ERROR);
+
+	flush_work(&pdata->recovery_work);
+
+	KUNIT_EXPECT_EQ(test, t->dma->terminated, 1u);
+	KUNIT_EXPECT_FALSE(test, pdata->recovering);
+	KUNIT_EXPECT_EQ(test, pdata->recoveries, 1u);
+	KUNIT_EXPECT_EQ(test, read_reg(pdata, 0x0020C000), 0x00000005u);
+	KUNIT_EXPECT_EQ(test, read_reg(pdata, 0x00209028), 0x00000000u);
+
+	/* the three remaining buffers went back to the channel */
+	KUNIT_EXPECT_EQ(test, t->dma->preps, 4u + 3u);
+	for (i = 1; i < 4; i++)
+		KUNIT_EXPECT_GT(test, t->bufs[i]->dma_cookie, (dma_cookie_t)4);
+
+	KUNIT_EXPECT_TRUE(test, mock_complete(t->dma, DMA_COMPLETE, 0));
+	KUNIT_EXPECT_EQ(test, test_state(t, 1), VB2_BUF_STATE_DONE);
+	KUNIT_EXPECT_EQ(test, pdata->failed_recoveries, 0u);
+	pdata->streaming = false;
+}
+
+static void psee_test_paused(struct kunit *test)
+{
+	struct psee_test *t = test->priv;
+	struct psee_video *pdata = t->pdata;
+
+	pdata->streaming = true;
+	test_queue(t, 0);
+	test_queue(t, 1);
+
+	KUNIT_EXPECT_TRUE(test, mock_complete(t->dma, DMA_PAUSED, SIZE_IMAGE));
+	/* nothing is retired, the buffer is resubmitted as is */
+	KUNIT_EXPECT_EQ(test, test_state(t, 0), VB2_BUF_STATE_ACTIVE);
+
+	flush_work(&pdata->recovery_work);
+	KUNIT_EXPECT_EQ(test, t->dma->terminated, 1u);
+	KUNIT_EXPECT_EQ(test, t->dma->preps, 4u);
+	KUNIT_EXPECT_TRUE(test, pdata->recovery_status == DMA_PAUSED);
+
+	KUNIT_EXPECT_TRUE(test, mock_complete(t->dma, DMA_COMPLETE, 0));
+	KUNIT_EXPECT_EQ(test, test_state(t, 0), VB2_BUF_STATE_DONE);
+	KUNIT_EXPECT_EQ(test, t->bufs[0]->vb.sequence, 0u);
+	pdata->streaming = false;
+}
+
+/* The queue is flagged in error once recoveries stop helping */
+static void psee_test_recovery_gives_up(struct kunit *test)
+{
+	struct psee_test *t = test->priv;
+	struct psee_video *pdata = t->pdata;
+	unsigned int i;
+
+	pdata->streaming = true;
+	test_queue(t, 0);
+
+	for (i = 0; i <= MAX_DMA_RECOVERIES; i++) {
+		KUNIT_ASSERT_TRUE(test, mock_complete(t->dma, DMA_PAUSED, 0));
+		flush_work(&pdata->recovery_work);
+	}
+
+	KUNIT_EXPECT_EQ(test, pdata->recoveries, (unsigned int)MAX_DMA_RECOVERIES);
+	KUNIT_EXPECT_TRUE(test, pdata->queue.error);
+	pdata->streaming = false;
+}
+
+static void psee_test_stop_in_flight(struct kunit *test)
+{
+	struct psee_test *t = test->priv;
+	struct psee_video *pdata = t->pdata;
+	unsigned int i;
+
+	pdata->streaming = true;
+	for (i = 0; i < 3; i++)
+		test_queue(t, i);
+	mock_complete(t->dma, DMA_COMPLETE, 0);
+
+	stop_streaming(&pdata->queue);
+
+	KUNIT_EXPECT_FALSE(test, pdata->streaming);
+	KUNIT_EXPECT_EQ(test, t->dma->terminated, 1u);
+	KUNIT_EXPECT_TRUE(test, list_empty(&pdata->buffers));
+	KUNIT_EXPECT_EQ(test, atomic_read(&pdata->queue.owned_by_drv_count), 0);
+	KUNIT_EXPECT_EQ(test, test_state(t, 0), VB2_BUF_STATE_DONE);
+	KUNIT_EXPECT_EQ(test, test_state(t, 1), VB2_BUF_STATE_ERROR);
+	KUNIT_EXPECT_EQ(test, test_state(t, 2), VB2_BUF_STATE_ERROR);
+	KUNIT_EXPECT_EQ(test, read_reg(pdata, 0x00209008), 0x00000644u);
+}
+
+/* A fault followed by STREAMOFF before the recovery ran must not wedge the queue */
+static void psee_test_stop_pending_recovery(struct kunit *test)
+{
+	struct psee_test *t = test->priv;
+	struct psee_video *pdata = t->pdata;
+	unsigned int i, preps;
+
+	pdata->streaming = true;
+	for (i = 0; i < 3; i++)
+		test_queue(t, i);
+	KUNIT_EXPECT_TRUE(test, mock_complete(t->dma, DMA_ERROR, 0));
+
+	stop_streaming(&pdata->queue);
+	KUNIT_EXPECT_FALSE(test, pdata->recovering);
+	KUNIT_EXPECT_EQ(test, atomic_read(&pdata->queue.owned_by_drv_count), 0);
+
+	/* the next stream gets its buffers to the DMA again */
+	KUNIT_ASSERT_EQ(test, start_streaming(&pdata->queue, 0), 0);
+	for (i = 0; i < 3; i++)
+		test_dequeue(t, i);
+	preps = t->dma->preps;
+	test_queue(t, 0);
+	KUNIT_EXPECT_EQ(test, t->dma->preps, preps + 1);
+	KUNIT_EXPECT_TRUE(test, mock_complete(t->dma, DMA_COMPLETE, 0));
+	KUNIT_EXPECT_EQ(test, test_state(t, 0), VB2_BUF_STATE_DONE);
+	KUNIT_EXPECT_EQ(test, t->bufs[0]->vb.sequence, 0u);
+	pdata->streaming = false;
+}
+
+/* A buffer the DMA could not take is failed, never retired as done */
+static void psee_test_prep_failure(struct kunit *test)
+{
+	struct psee_test *t = test->priv;
+	struct psee_video *pdata = t->pdata;
+	unsigned int i;
+
+	pdata->streaming = true;
+	test_queue(t, 0);
+	t->dma->fail_preps = 1;
+	test_queue(t, 1);
+	test_queue(t, 2);
+
+	KUNIT_EXPECT_EQ(test, test_state(t, 1), VB2_BUF_STATE_ERROR);
+	KUNIT_EXPECT_EQ(test, vb2_get_plane_payload(&t->bufs[1]->vb.vb2_buf, 0),
+			0ul);
+	KUNIT_EXPECT_TRUE(test, mock_complete(t->dma, DMA_COMPLETE, 0));
+	KUNIT_EXPECT_TRUE(test, mock_complete(t->dma, DMA_COMPLETE, 0));
+	KUNIT_EXPECT_EQ(test, test_state(t, 2), VB2_BUF_STATE_DONE);
+	KUNIT_EXPECT_EQ(test, t->bufs[2]->vb.sequence, 1u);
+
+	/* same when the recovery resubmits the list */
+	for (i = 3; i < 6; i++)
+		test_queue(t, i);
+	t->dma->fail_preps = 1;
+	KUNIT_EXPECT_TRUE(test, mock_complete(t->dma, DMA_ERROR, 0));
+	flush_work(&pdata->recovery_work);
+	KUNIT_EXPECT_EQ(test, test_state(t, 4), VB2_BUF_STATE_ERROR);
+	KUNIT_EXPECT_EQ(test, test_state(t, 5), VB2_BUF_STATE_ACTIVE);
+	KUNIT_EXPECT_TRUE(test, mock_complete(t->dma, DMA_COMPLETE, 0));
+	KUNIT_EXPECT_EQ(test, test_state(t, 5), VB2_BUF_STATE_DONE);
+	KUNIT_EXPECT_TRUE(test, list_empty(&pdata->buffers));
+	pdata->streaming = false;
+}
+
+static void psee_test_coalescing(struct kunit *test)
+{
+	struct psee_test *t = test->priv;
+	unsigned int i;
+
+	/* keep the timer out of the way until the tail test below */
+	irq_coalesce = 4;
+	irq_coalesce_us = USEC_PER_SEC;
+
+	for (i = 0; i < TEST_BUFFERS; i++)
+		test_queue(t, i);
+
+	for (i = 0; i < TEST_BUFFERS; i++)
+		KUNIT_EXPECT_EQ(test, !!(mock_cookie_desc(t->dma,
+				t->bufs[i]->dma_cookie)->tx.flags & DMA_PREP_INTERRUPT),
+				i % 4 == 3);
+
+	/* nothing is retired until the interrupting descriptor completes */
+	for (i = 0; i < 3; i++)
+		mock_complete(t->dma, DMA_COMPLETE, 0);
+	KUNIT_EXPECT_EQ(test, test_state(t, 0), VB2_BUF_STATE_ACTIVE);
+
+	mock_complete(t->dma, DMA_COMPLETE, 0);
+	for (i = 0; i < 4; i++) {
+		KUNIT_EXPECT_EQ(test, test_state(t, i), VB2_BUF_STATE_DONE);
+		KUNIT_EXPECT_EQ(test, t->bufs[i]->vb.sequence, i);
+	}
+	KUNIT_EXPECT_EQ(test, t->dma->interrupts, 1u);
+	/* every buffer in flight has an interrupt behind it: no polling */
+	KUNIT_EXPECT_FALSE(test, hrtimer_is_queued(&t->pdata->coalesce_timer));
+
+	/* a tail without interrupt is retired by the timer */
+	irq_coalesce_us = 100;
+	for (i = 0; i < 4; i++)
+		test_dequeue(t, i);
+	test_queue(t, 0);
+	for (i = 4; i < TEST_BUFFERS; i++)
+		mock_complete(t->dma, DMA_COMPLETE, 0);
+	mock_complete(t->dma, DMA_COMPLETE, 0);
+	KUNIT_EXPECT_EQ(test, test_state(t, 7), VB2_BUF_STATE_DONE);
+
+	msleep(20);
+	KUNIT_EXPECT_EQ(test, test_state(t, 0), VB2_BUF_STATE_DONE);
+	KUNIT_EXPECT_TRUE(test, list_empty(&t->pdata->buffers));
+}
+
+static void psee_test_tap(struct kunit *test)
+{
+	struct psee_test *t = test->priv;
+	struct psee_video *pdata = t->pdata;
+	struct psee_tap *tap;
+
+	tap = kunit_kzalloc(test, sizeof(*tap), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, tap);
+	tap->max_lag = 2;
+	init_waitqueue_head(&tap->wait);
+	list_add_tail(&tap->list, &pdata->taps);
+
+	test_queue(t, 0);
+	test_queue(t, 1);
+	test_queue(t, 2);
+	mock_complete(t->dma, DMA_COMPLETE, SIZE_IMAGE - 10);
+
+	KUNIT_EXPECT_EQ(test, tap->pending_count, 1u);
+	KUNIT_EXPECT_EQ(test, tap->pending[0].index, 0u);
+	KUNIT_EXPECT_EQ(test, tap->pending[0].bytesused, 10u);
+	KUNIT_EXPECT_EQ(test, t->bufs[0]->taps, 1u);
+
+	/* requeued by the owner while the tap still reads it: parked */
+	test_dequeue(t, 0);
+	test_queue(t, 0);
+	KUNIT_EXPECT_TRUE(test, t->bufs[0]->parked);
+	KUNIT_EXPECT_EQ(test, t->dma->preps, 3u);
+
+	/* the tap lags: its oldest buffer is dropped and goes back to DMA */
+	mock_complete(t->dma, DMA_COMPLETE, 0);
+	mock_complete(t->dma, DMA_COMPLETE, 0);
+	KUNIT_EXPECT_EQ(test, tap->dropped, 1ull);
+	KUNIT_EXPECT_EQ(test, tap->pending_count, 2u);
+	KUNIT_EXPECT_FALSE(test, t->bufs[0]->parked);
+	KUNIT_EXPECT_EQ(test, t->dma->preps, 4u);
+
+	list_del(&tap->list);
+}
+
+/* A tap that stopped reading cannot starve the DMA of buffers */
+static void psee_test_tap_stalled(struct kunit *test)
+{
+	struct psee_test *t = test->priv;
+	struct psee_video *pdata = t->pdata;
+	struct psee_tap *tap;
+	unsigned int i;
+
+	tap = kunit_kzalloc(test, sizeof(*tap), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, tap);
+	tap->max_lag = VB2_MAX_FRAME;
+	init_waitqueue_head(&tap->wait);
+	list_add_tail(&tap->list, &pdata->taps);
+
+	/* max_lag is capped to TEST_BUFFERS - MIN_BUFFERS_NEEDED */
+	KUNIT_EXPECT_EQ(test, tap_lag_limit(pdata, tap),
+			(unsigned int)(TEST_BUFFERS - MIN_BUFFERS_NEEDED));
+	tap->max_lag = 4;
+
+	for (i = 0; i < 4; i++)
+		test_queue(t, i);
+	for (i = 0; i < 4; i++)
+		mock_complete(t->dma, DMA_COMPLETE, 0);
+	KUNIT_EXPECT_EQ(test, tap->pending_count, 4u);
+	KUNIT_EXPECT_EQ(test, tap->dropped, 0ull);
+
+	/* the owner requeues everything while the tap holds it all */
+	for (i = 0; i < 4; i++) {
+		test_dequeue(t, i);
+		test_queue(t, i);
+	}
+
+	/* the two oldest were taken back to keep two buffers in flight */
+	KUNIT_EXPECT_EQ(test, t->dma->preps, 6u);
+	KUNIT_EXPECT_EQ(test, tap->dropped, 2ull);
+	KUNIT_EXPECT_EQ(test, tap->pending_count, 2u);
+	KUNIT_EXPECT_EQ(test, tap->pending[tap->pending_head].index, 2u);
+	KUNIT_EXPECT_FALSE(test, t->bufs[0]->parked);
+	KUNIT_EXPECT_FALSE(test, t->bufs[1]->parked);
+	KUNIT_EXPECT_TRUE(test, t->bufs[2]->parked);
+	KUNIT_EXPECT_TRUE(test, t->bufs[3]->parked);
+
+	/* and the capture goes on */
+	KUNIT_EXPECT_TRUE(test, mock_complete(t->dma, DMA_COMPLETE, 0));
+	KUNIT_EXPECT_EQ(test, test_state(t, 0), VB2_BUF_STATE_DONE);
+	KUNIT_EXPECT_EQ(test, tap->pending_count, 3u);
+
+	list_del(&tap->list);
+}
+
+static void psee_test_ring_callback(struct kunit *test)
+{
+	struct psee_test *t = test->priv;
+	struct psee_ring *ring = &t->pdata->ring;
+	struct dma_async_tx_descriptor *desc;
+	unsigned int i;
+
+	ring->ctrl = kunit_kzalloc(test, PAGE_SIZE, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, ring->ctrl);
+	ring->size = 4 * PAGE_SIZE;
+	ring->period = PAGE_SIZE;
+
+	desc = dmaengine_prep_dma_cyclic(&t->dma->chan, 0, ring->size,
+					 ring->period, DMA_DEV_TO_MEM, 0);
+	ring->cookie = dmaengine_submit(desc);
+
+	for (i = 0; i < 6; i++)
+		ring_callback(t->pdata);
+
+	/* the DMA is writing [6, 7) over [2, 3): only [3, 6) is readable */
+	KUNIT_EXPECT_EQ(test, ring->ctrl->data_head, 6ull * PAGE_SIZE);
+	KUNIT_EXPECT_EQ(test, ring->ctrl->lost, 3ull * PAGE_SIZE);
+
+	/* the consumer caught up, nothing more is lost */
+	ring->ctrl->data_tail = 6 * PAGE_SIZE;
+	ring_callback(t->pdata);
+	KUNIT_EXPECT_EQ(test, ring->ctrl->lost, 3ull * PAGE_SIZE);
+
+	/* 100 bytes of the next period are already written */
+	mock_cookie_desc(t->dma, ring->cookie)->residue =
+		ring->size - (7 * PAGE_SIZE % ring->size) - 100;
+	KUNIT_EXPECT_EQ(test, ring_current_head(t->pdata, ring->ctrl->data_head),
+			7ull * PAGE_SIZE + 100);
+}
+
+/*
+ * Per buffer cost of buffer_queue() -> DMA completion -> vb2_buffer_done(),
+ * buffers being requeued as soon as their interrupt retired them.
+ */
+static u64 bench_cycle(struct psee_test *t, unsigned int coalesce)
+{
+	unsigned int i, j, n;
+	u64 start;
+
+	irq_coalesce = coalesce;
+	/* only the interrupting descriptors retire buffers */
+	irq_coalesce_us = USEC_PER_SEC;
+
+	for (n = 0; n < TEST_BUFFERS; n++)
+		test_queue(t, n);
+
+	start = ktime_get_ns();
+	for (i = 0; i < TEST_BENCH_LOOPS; i++) {
+		mock_complete(t->dma, DMA_COMPLETE, 0);
+
+		n = i % TEST_BUFFERS;
+		if (n % coalesce != coalesce - 1)
+			continue;
+
+		INIT_LIST_HEAD(&t->pdata->queue.done_list);
+		for (j = n + 1 - coalesce; j <= n; j++) {
+			t->bufs[j]->vb.vb2_buf.state = VB2_BUF_STATE_DEQUEUED;
+			test_queue(t, j);
+		}
+	}
+
+	return div_u64(ktime_get_ns() - start, TEST_BENCH_LOOPS);
+}
+
+static void psee_test_bench_hot_path(struct kunit *test)
+{
+	struct psee_test *t = test->priv;
+	u64 ns;
+
+	ns = bench_cycle(t, 1);
+	kunit_info(test, "queue->complete: %llu ns/buffer\n", ns);
+	KUNIT_EXPECT_EQ(test, atomic_read(&t->pdata->queue.owned_by_drv_count),
+			TEST_BUFFERS);
+	KUNIT_EXPECT_EQ(test, t->dma->interrupts, (unsigned int)TEST_BENCH_LOOPS);
+}
+
+static void psee_test_bench_hot_path_coalesced(struct kunit *test)
+{
+	struct psee_test *t = test->priv;
+	u64 ns;
+
+	ns = bench_cycle(t, 4);
+	kunit_info(test, "queue->complete, 1 irq/4 buffers: %llu ns/buffer\n", ns);
+	KUNIT_EXPECT_EQ(test, t->dma->interrupts,
+			(unsigned int)TEST_BENCH_LOOPS / 4);
+}
+
+static void psee_test_bench_registers(struct kunit *test)
+{
+	struct psee_test *t = test->priv;
+	struct psee_video *pdata = t->pdata;
+	u64 start, on, off, reset;
+
+	start = ktime_get_ns();
+	enable_output(pdata);
+	on = ktime_get_ns() - start;
+
+	start = ktime_get_ns();
+	disable_output(pdata);
+	off = ktime_get_ns() - start;
+
+	start = ktime_get_ns();
+	reset_output_path(pdata);
+	reset = ktime_get_ns() - start;
+
+	kunit_info(test, "enable_output: %llu us, disable_output: %llu us, reset_output_path: %llu us\n",
+		   div_u64(on, NSEC_PER_USEC), div_u64(off, NSEC_PER_USEC),
+		   div_u64(reset, NSEC_PER_USEC));
+
+	KUNIT_EXPECT_EQ(test, read_reg(pdata, 0x00200004), 0xF0005042u);
+	KUNIT_EXPECT_EQ(test, read_reg(pdata, 0x0020002C), 0x0022C324u);
+	KUNIT_EXPECT_EQ(test, read_reg(pdata, 0x0010F000), 0x00400001u);
+}
+
+static struct kunit_case psee_video_test_cases[] = {
+	KUNIT_CASE(psee_test_queue_order),
+	KUNIT_CASE(psee_test_in_order_retire),
+	KUNIT_CASE(psee_test_payload),
+	KUNIT_CASE(psee_test_error_recovery),
+	KUNIT_CASE(psee_test_paused),
+	KUNIT_CASE(psee_test_recovery_gives_up),
+	KUNIT_CASE(psee_test_stop_in_flight),
+	KUNIT_CASE(psee_test_stop_pending_recovery),
+	KUNIT_CASE(psee_test_prep_failure),
+	KUNIT_CASE(psee_test_coalescing),
+	KUNIT_CASE(psee_test_tap),
+	KUNIT_CASE(psee_test_tap_stalled),
+	KUNIT_CASE(psee_test_ring_callback),
+	KUNIT_CASE(psee_test_bench_hot_path),
+	KUNIT_CASE(psee_test_bench_hot_path_coalesced),
+	KUNIT_CASE(psee_test_bench_registers),
+	{}
+};
+
+static struct kunit_suite psee_video_test_suite = {
+	.name = "psee-video",
+	.init = psee_test_init,
+	.exit = psee_test_exit,
+	.test_cases = psee_video_test_cases,
+};
+
+kunit_test_suite(psee_video_test_suite);
@@ -13,6 +13,12 @@
 #include <linux/dmaengine.h>
 #include <linux/dma-mapping.h>
 #include <linux/delay.h>
+#include <linux/workqueue.h>
+#include <linux/hrtimer.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/log2.h>
+#include <linux/version.h>
 
 #include <media/media-device.h>
 #include <media/media-entity.h>
@@ -26,6 +32,35 @@
 #include <linux/of_address.h>
 #include <linux/of_device.h>
 #include <linux/of_platform.h>
+#include <linux/of_reserved_mem.h>
+
+#include "psee-video.h"
+
+/* renamed in 5.7 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 7, 0)
+#define VFL_TYPE_VIDEO VFL_TYPE_GRABBER
+#endif
+
+/* the fallthrough pseudo-keyword appeared in 5.4 */
+#ifndef fallthrough
+#define fallthrough __attribute__((__fallthrough__))
+#endif
+
+/* vma->vm_flags may only be changed through helpers since 6.3 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 3, 0)
+static inline void vm_flags_clear(struct vm_area_struct *vma, vm_flags_t flags)
+{
+	vma->vm_flags &= ~flags;
+}
+#endif
+
+/* the queue buffers may only be reached through helpers since 6.8 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 8, 0)
+static inline unsigned int vb2_get_num_buffers(struct vb2_queue *q)
+{
+	return q->num_buffers;
+}
+#endif
 
 #define OUT 0
 #define IN 1
@@ -34,14 +69,79 @@
 #define BYTES_PER_LINE (1lu << 20)
 #define SIZE_IMAGE BYTES_PER_LINE
 
+#define TAP_DEFAULT_MAX_LAG 4
+
+/* issues were seen below 4 buffers, to be investigated */
+#define MIN_BUFFERS_NEEDED 4
+
+#define RING_DEFAULT_SIZE (16lu << 20)
+#define RING_DEFAULT_PERIOD (64lu << 10)
+/* bounds the coherent allocation and the descriptors of the cyclic DMA */
+#define RING_MAX_SIZE (64lu << 20)
+
+/* consecutive DMA recoveries without a completed buffer before giving up */
+#define MAX_DMA_RECOVERIES 8
+
+/* the coalescing timer backs off up to 2^N times irq_coalesce_us when idle */
+#define COALESCE_MAX_BACKOFF 6
+
 static int video_nr = -1;
 module_param(video_nr, uint, 0644);
 MODULE_PARM_DESC(video_nr, "videoX start number, -1 is autodetect");
 
+static unsigned int irq_coalesce = 1;
+module_param(irq_coalesce, uint, 0644);
+MODULE_PARM_DESC(irq_coalesce, "raise a DMA interrupt every N buffers, 1 disables coalescing, "
+		 "buffers retired by the same interrupt share its timestamp");
+
+static unsigned int irq_coalesce_us = 1000;
+module_param(irq_coalesce_us, uint, 0644);
+MODULE_PARM_DESC(irq_coalesce_us, "delay before polling for buffers with no interrupt, in us, "
+		 "doubled while none completes, up to 64 times");
+
 struct psee_buffer {
 	struct vb2_v4l2_buffer vb;
 	struct list_head list;
 	dma_cookie_t dma_cookie;
+	unsigned int taps;	/* taps still reading it, under qlock */
+	bool parked;		/* requeued, waiting for the taps to put it */
+	struct psee_tap_buffer tap_info;	/* what the taps are handed */
+};
+
+/* mmap'd ring capture over a cyclic DMA, see ring_start() */
+struct psee_ring {
+	struct mutex lock;		/* protects all but the callback state */
+	struct file *owner;		/* file which started the ring */
+	struct psee_ring_ctrl *ctrl;	/* control page shared with userspace */
+	void *cpu_addr;
+	dma_addr_t dma_addr;
+	size_t size;
+	size_t period;
+	atomic_t mappings;
+	bool running;
+	bool reader;			/* consumed with read() */
+	dma_cookie_t cookie;
+	/* callback state */
+	u64 head;
+	u64 lost_upto;
+	wait_queue_head_t wait;
+};
+
+/* read-only consumer of the vb2 buffers, see tap_publish() */
+struct psee_tap {
+	struct list_head list;
+	struct file *file;
+	unsigned int max_lag;
+	/* completed buffers not handed out yet, oldest first */
+	struct psee_tap_buffer pending[VB2_MAX_FRAME];
+	unsigned int pending_head;
+	unsigned int pending_count;
+	/* buffers handed out and not put yet */
+	DECLARE_BITMAP(held, VB2_MAX_FRAME);
+	u32 held_sequence[VB2_MAX_FRAME];
+	unsigned int held_count;
+	u64 dropped;
+	wait_queue_head_t wait;
 };
 
 static inline struct psee_buffer *to_psee_buffer(struct vb2_buffer *vb2)
@@ -60,7 +160,25 @@ struct psee_video {
 	struct vb2_queue queue;
 	spinlock_t qlock;
 	struct list_head buffers;
+	struct list_head parked;
+	struct list_head taps;
 	int sequence;
+	bool streaming;
+	/* in-stream DMA error recovery, see recovery_work() */
+	struct work_struct recovery_work;
+	bool recovering;
+	enum dma_status recovery_status;
+	unsigned int recoveries;
+	unsigned int failed_recoveries;
+	ktime_t fault_time;
+	u64 max_gap_ns;
+	/* interrupt coalescing, see submit_buffer() */
+	struct hrtimer coalesce_timer;
+	unsigned int since_irq;
+	unsigned int coalesce_backoff;
+	/* CPU sync of non-coherent buffers limited to the payload */
+	bool payload_sync;
+	struct psee_ring ring;
 	struct resource *reg_resource;
 	void __iomem *regmap;
 };
@@ -323,6 +441,825 @@ esfmt:
 	return ret;
 }
 
+/*
+ * Start and stop the event stream out of the FPGA, for both the vb2
+ * streaming and the ring capture.
+ */
+static void enable_output(struct psee_video *pdata)
+{
+	write_reg(pdata, 0x0010F000, 0x00400001);
+	write_reg(pdata, 0x0020B000, 0x00000159);
+	write_reg(pdata, 0x00209028, 0x00000000);
+	write_reg(pdata, 0x00209008, 0x00000645);
+	write_reg(pdata, 0x0020002C, 0x0022C724);
+	write_reg(pdata, 0x00200004, 0xF0005442);
+}
+
+static void disable_output(struct psee_video *pdata)
+{
+	write_reg(pdata, 0x00200004, 0xF0005042);
+	write_reg(pdata, 0x0020002C, 0x0022C324);
+	write_reg(pdata, 0x0020C000, 0x00000002);
+	write_reg(pdata, 0x00209028, 0x00000002);
+	write_reg(pdata, 0x0020C000, 0x00000005);
+	write_reg(pdata, 0x00209008, 0x00000644);
+}
+
+/*
+ * Oldest data of the ring not being overwritten once the DMA published
+ * head: it is already filling the period that follows.
+ */
+static u64 ring_oldest(struct psee_ring *ring, u64 head)
+{
+	return head + ring->period > ring->size ?
+	       head + ring->period - ring->size : 0;
+}
+
+/*
+ * Called by the cyclic DMA each time a period of the ring has been filled:
+ * publish the new head to userspace and account the data it overwrote,
+ * including the period the DMA moved on to.
+ */
+static void ring_callback(void *param)
+{
+	struct psee_video *pdata = (struct psee_video *)param;
+	struct psee_ring *ring = &pdata->ring;
+	struct psee_ring_ctrl *ctrl = ring->ctrl;
+	u64 oldest, tail;
+
+	ring->head += ring->period;
+	oldest = ring_oldest(ring, ring->head);
+	tail = max_t(u64, READ_ONCE(ctrl->data_tail), ring->lost_upto);
+	if (tail < oldest) {
+		WRITE_ONCE(ctrl->lost, ctrl->lost + oldest - tail);
+		ring->lost_upto = oldest;
+	}
+
+	WRITE_ONCE(ctrl->timestamp_ns, ktime_get_ns());
+	/* pairs with the consumer's acquire of data_head */
+	smp_store_release(&ctrl->data_head, ring->head);
+	wake_up_interruptible(&ring->wait);
+}
+
+static void ring_free(struct psee_video *pdata)
+{
+	struct psee_ring *ring = &pdata->ring;
+
+	if (ring->cpu_addr)
+		dma_free_coherent(pdata->mdev.dev, ring->size, ring->cpu_addr,
+				  ring->dma_addr);
+	if (ring->ctrl)
+		free_page((unsigned long)ring->ctrl);
+	ring->cpu_addr = NULL;
+	ring->ctrl = NULL;
+	ring->size = 0;
+}
+
+static int ring_alloc(struct psee_video *pdata, size_t size)
+{
+	struct psee_ring *ring = &pdata->ring;
+
+	if (ring->cpu_addr && ring->size == size)
+		return 0;
+
+	/* userspace still has the old ring mapped */
+	if (atomic_read(&ring->mappings))
+		return -EBUSY;
+
+	ring_free(pdata);
+
+	ring->ctrl = (struct psee_ring_ctrl *)get_zeroed_page(GFP_KERNEL);
+	if (!ring->ctrl)
+		return -ENOMEM;
+
+	ring->cpu_addr = dma_alloc_coherent(pdata->mdev.dev, size,
+					    &ring->dma_addr, GFP_KERNEL);
+	if (!ring->cpu_addr) {
+		dev_err(pdata->mdev.dev, "%s: could not allocate %zu bytes ring\n",
+			__func__, size);
+		ring_free(pdata);
+		return -ENOMEM;
+	}
+	ring->size = size;
+
+	return 0;
+}
+
+/*
+ * Start the ring capture: a single cyclic DMA transaction fills the ring
+ * forever, with an interrupt per period. Called with pdata->lock held, the
+ * vb2 queue must not be in use.
+ */
+static int ring_start(struct file *file, struct psee_ring_config *cfg)
+{
+	struct psee_video *pdata = video_drvdata(file);
+	struct psee_ring *ring = &pdata->ring;
+	struct dma_async_tx_descriptor *desc;
+	size_t size = cfg->size ? cfg->size : RING_DEFAULT_SIZE;
+	size_t period = cfg->period_size ? cfg->period_size : RING_DEFAULT_PERIOD;
+	int ret;
+
+	if (!is_power_of_2(size) || !is_power_of_2(period) ||
+	    period < PAGE_SIZE || period > size / 2 || size > RING_MAX_SIZE)
+		return -EINVAL;
+
+	if (vb2_is_busy(&pdata->queue))
+		return -EBUSY;
+
+	mutex_lock(&ring->lock);
+
+	if ((ring->owner && ring->owner != file) || ring->running) {
+		ret = -EBUSY;
+		goto unlock;
+	}
+
+	ret = ring_alloc(pdata, size);
+	if (ret)
+		goto unlock;
+
+	ring->period = period;
+	ring->head = 0;
+	ring->lost_upto = 0;
+	memset(ring->ctrl, 0, sizeof(*ring->ctrl));
+	ring->ctrl->data_size = size;
+	ring->ctrl->period_size = period;
+
+	desc = dmaengine_prep_dma_cyclic(pdata->chan[OUT], ring->dma_addr,
+					 size, period, DMA_DEV_TO_MEM,
+					 DMA_PREP_INTERRUPT);
+	if (!desc) {
+		dev_err(pdata->mdev.dev, "%s: DMA prep_cyclic failed\n", __func__);
+		ret = -EIO;
+		goto unlock;
+	}
+
+	desc->callback = ring_callback;
+	desc->callback_param = pdata;
+
+	ring->cookie = dmaengine_submit(desc);
+	if (dma_submit_error(ring->cookie)) {
+		dev_err(pdata->mdev.dev, "%s: DMA submission failed\n", __func__);
+		ret = -EIO;
+		goto unlock;
+	}
+	dma_async_issue_pending(pdata->chan[OUT]);
+
+	enable_output(pdata);
+
+	ring->owner = file;
+	ring->running = true;
+	ring->reader = false;
+	cfg->size = size;
+	cfg->period_size = period;
+
+unlock:
+	mutex_unlock(&ring->lock);
+	return ret;
+}
+
+/* Called with ring->lock held */
+static void ring_stop(struct psee_video *pdata)
+{
+	struct psee_ring *ring = &pdata->ring;
+
+	if (!ring->running)
+		return;
+
+	disable_output(pdata);
+	dmaengine_terminate_sync(pdata->chan[OUT]);
+	ring->running = false;
+	wake_up_interruptible(&ring->wait);
+}
+
+/* The ring belongs to its owner file until it is closed */
+static void ring_release(struct file *file)
+{
+	struct psee_video *pdata = video_drvdata(file);
+	struct psee_ring *ring = &pdata->ring;
+
+	mutex_lock(&ring->lock);
+	if (ring->owner == file) {
+		ring_stop(pdata);
+		ring_free(pdata);
+		ring->owner = NULL;
+	}
+	mutex_unlock(&ring->lock);
+}
+
+static void ring_vm_open(struct vm_area_struct *vma)
+{
+	struct psee_video *pdata = vma->vm_private_data;
+
+	atomic_inc(&pdata->ring.mappings);
+}
+
+static void ring_vm_close(struct vm_area_struct *vma)
+{
+	struct psee_video *pdata = vma->vm_private_data;
+
+	atomic_dec(&pdata->ring.mappings);
+}
+
+static const struct vm_operations_struct ring_vm_ops = {
+	.open	= ring_vm_open,
+	.close	= ring_vm_close,
+};
+
+/*
+ * Map the control page (read-write and shared, userspace owns data_tail)
+ * or the ring itself (read-only).
+ */
+static int ring_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct psee_video *pdata = video_drvdata(file);
+	struct psee_ring *ring = &pdata->ring;
+	unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
+	unsigned long len = vma->vm_end - vma->vm_start;
+	int ret = -EINVAL;
+
+	mutex_lock(&ring->lock);
+
+	if (ring->owner != file || !ring->cpu_addr)
+		goto unlock;
+
+	if (offset == PSEE_RING_CTRL_OFFSET) {
+		/* a private copy would never see data_tail reach us */
+		if (len != PAGE_SIZE || !(vma->vm_flags & VM_SHARED))
+			goto unlock;
+		ret = remap_pfn_range(vma, vma->vm_start,
+				      virt_to_phys(ring->ctrl) >> PAGE_SHIFT,
+				      PAGE_SIZE, vma->vm_page_prot);
+	} else {
+		if (len > ring->size || (vma->vm_flags & VM_WRITE))
+			goto unlock;
+		vm_flags_clear(vma, VM_MAYWRITE);
+		vma->vm_pgoff = 0;
+		ret = dma_mmap_coherent(pdata->mdev.dev, vma, ring->cpu_addr,
+					ring->dma_addr, ring->size);
+	}
+	if (ret)
+		goto unlock;
+
+	vma->vm_ops = &ring_vm_ops;
+	vma->vm_private_data = pdata;
+	atomic_inc(&ring->mappings);
+
+unlock:
+	mutex_unlock(&ring->lock);
+	return ret;
+}
+
+/*
+ * Producer position including the part of the period after head already
+ * written, derived from the residue of the cyclic transaction. head is a
+ * data_head snapshot of the caller. Falls back to it while the period
+ * callback is pending.
+ */
+static u64 ring_current_head(struct psee_video *pdata, u64 head)
+{
+	struct psee_ring *ring = &pdata->ring;
+	struct dma_tx_state state;
+	size_t pos, partial;
+
+	if (dmaengine_tx_status(pdata->chan[OUT], ring->cookie, &state) !=
+	    DMA_IN_PROGRESS || !state.residue || state.residue > ring->size)
+		return head;
+
+	pos = ring->size - state.residue;
+	partial = (pos - head) & (ring->size - 1);
+	if (partial >= ring->period)
+		return head;
+
+	return head + partial;
+}
+
+/*
+ * Byte-stream read() on top of the ring capture, which is started with the
+ * default geometry on the first read() if this file does not own a ring
+ * yet. Returns at once if any byte is available, including the part of the
+ * period being filled, and copies straight from the ring to userspace.
+ * Otherwise sleeps until the next period completes. The data_tail of the
+ * control page is the read cursor.
+ *
+ * Data overwritten before being read, which ring_callback() accounts in
+ * lost, is skipped and the read fails with -EOVERFLOW, so that the gap in
+ * the event stream is never silent. So does a read during which the DMA
+ * caught up with the data being copied.
+ */
+static ssize_t psee_video_read(struct file *file, char __user *data,
+			       size_t count, loff_t *ppos)
+{
+	struct psee_video *pdata = video_drvdata(file);
+	struct psee_ring *ring = &pdata->ring;
+	struct psee_ring_config cfg = { };
+	size_t len, off, chunk;
+	u64 published, head, tail, oldest;
+	ssize_t ret;
+
+	if (mutex_lock_interruptible(&pdata->lock))
+		return -ERESTARTSYS;
+
+	if (READ_ONCE(ring->owner) != file) {
+		ret = ring_start(file, &cfg);
+		if (ret)
+			goto unlock;
+	}
+	WRITE_ONCE(ring->reader, true);
+
+	for (;;) {
+		/* head and oldest must come from the same data_head */
+		published = smp_load_acquire(&ring->ctrl->data_head);
+		head = ring_current_head(pdata, published);
+		tail = READ_ONCE(ring->ctrl->data_tail);
+
+		/* the DMA overwrote what we did not read in time */
+		oldest = ring_oldest(ring, published);
+		if (tail < oldest) {
+			WRITE_ONCE(ring->ctrl->data_tail, oldest);
+			ret = -EOVERFLOW;
+			goto unlock;
+		}
+
+		/* data_tail may be ahead while a period callback is pending */
+		if (head > tail || !count)
+			break;
+
+		if (!ring->running) {
+			ret = 0;
+			goto unlock;
+		}
+
+		if (file->f_flags & O_NONBLOCK) {
+			ret = -EAGAIN;
+			goto unlock;
+		}
+
+		/* the ring lives until its owner file is released */
+		mutex_unlock(&pdata->lock);
+		ret = wait_event_interruptible(ring->wait,
+				READ_ONCE(ring->ctrl->data_head) != published ||
+				!READ_ONCE(ring->running));
+		if (ret)
+			return ret;
+		if (mutex_lock_interruptible(&pdata->lock))
+			return -ERESTARTSYS;
+	}
+
+	/* never more than what the DMA cannot be writing over */
+	len = min_t(u64, head - tail, min(count, ring->size - ring->period));
+	off = tail & (ring->size - 1);
+	chunk = min(len, ring->size - off);
+
+	if (copy_to_user(data, ring->cpu_addr + off, chunk) ||
+	    copy_to_user(data + chunk, ring->cpu_addr, len - chunk)) {
+		ret = -EFAULT;
+		goto unlock;
+	}
+
+	/* the DMA may have overwritten the start of what was just copied */
+	oldest = ring_oldest(ring, smp_load_acquire(&ring->ctrl->data_head));
+	if (tail < oldest) {
+		WRITE_ONCE(ring->ctrl->data_tail, oldest);
+		ret = -EOVERFLOW;
+		goto unlock;
+	}
+
+	WRITE_ONCE(ring->ctrl->data_tail, tail + len);
+	ret = len;
+
+unlock:
+	mutex_unlock(&pdata->lock);
+	return ret;
+}
+
+static void queue_to_dma(struct psee_video *pdata, struct psee_buffer *buf);
+
+static struct psee_buffer *index_to_buffer(struct psee_video *pdata,
+					   unsigned int index)
+{
+	return to_psee_buffer(vb2_get_buffer(&pdata->queue, index));
+}
+
+/* Called with qlock held, once a tap is done with a buffer */
+static void tap_unref(struct psee_video *pdata, unsigned int index)
+{
+	struct psee_buffer *buf = index_to_buffer(pdata, index);
+
+	if (--buf->taps || !buf->parked)
+		return;
+
+	buf->parked = false;
+	list_del(&buf->list);
+	queue_to_dma(pdata, buf);
+}
+
+/* Drop the oldest buffer of a lagging tap, pending ones first */
+static void tap_drop_oldest(struct psee_video *pdata, struct psee_tap *tap)
+{
+	unsigned int index, i;
+
+	if (tap->pending_count) {
+		index = tap->pending[tap->pending_head].index;
+		tap->pending_head = (tap->pending_head + 1) % VB2_MAX_FRAME;
+		tap->pending_count--;
+	} else {
+		index = find_first_bit(tap->held, VB2_MAX_FRAME);
+		for_each_set_bit(i, tap->held, VB2_MAX_FRAME)
+			if ((s32)(tap->held_sequence[i] - tap->held_sequence[index]) < 0)
+				index = i;
+		clear_bit(index, tap->held);
+		tap->held_count--;
+	}
+
+	tap->dropped++;
+	tap_unref(pdata, index);
+}
+
+/* Take a buffer back from a tap, which sees it as dropped */
+static void tap_forget(struct psee_video *pdata, struct psee_tap *tap,
+		       unsigned int index)
+{
+	unsigned int i, slot, kept = 0;
+	bool found = false;
+
+	if (test_and_clear_bit(index, tap->held)) {
+		tap->held_count--;
+		found = true;
+	} else {
+		for (i = 0; i < tap->pending_count; i++) {
+			slot = (tap->pending_head + i) % VB2_MAX_FRAME;
+			if (!found && tap->pending[slot].index == index) {
+				found = true;
+				continue;
+			}
+			tap->pending[(tap->pending_head + kept) % VB2_MAX_FRAME] =
+				tap->pending[slot];
+			kept++;
+		}
+		tap->pending_count = kept;
+	}
+
+	if (!found)
+		return;
+	tap->dropped++;
+	tap_unref(pdata, index);
+}
+
+/*
+ * Called with qlock held once a requeued buffer got parked. Lagging taps
+ * are only trimmed when a buffer completes, which a DMA left without
+ * buffers never does: the oldest parked buffer is taken back from the taps
+ * as soon as less than two buffers are in flight.
+ */
+static void tap_reclaim(struct psee_video *pdata)
+{
+	struct psee_buffer *buf;
+	struct psee_tap *tap;
+	unsigned int index;
+
+	if (list_empty(&pdata->parked) ||
+	    (!list_empty(&pdata->buffers) && !list_is_singular(&pdata->buffers)))
+		return;
+
+	buf = list_first_entry(&pdata->parked, struct psee_buffer, list);
+	index = buf->vb.vb2_buf.index;
+	list_for_each_entry(tap, &pdata->taps, list)
+		tap_forget(pdata, tap, index);
+}
+
+/* max_lag, leaving the owner and the DMA the buffers streaming needs */
+static unsigned int tap_lag_limit(struct psee_video *pdata,
+				  struct psee_tap *tap)
+{
+	unsigned int num = vb2_get_num_buffers(&pdata->queue);
+
+	if (num <= MIN_BUFFERS_NEEDED)
+		return 1;
+	return min(tap->max_lag, num - MIN_BUFFERS_NEEDED);
+}
+
+/*
+ * Hand a completed buffer to every attached tap. Called with qlock held,
+ * the buffer only goes back to the DMA once all of them have put it.
+ */
+static void tap_publish(struct psee_video *pdata, struct psee_buffer *buf)
+{
+	struct psee_tap_buffer *entry;
+	struct psee_tap *tap;
+
+	list_for_each_entry(tap, &pdata->taps, list) {
+		if (tap->pending_count + tap->held_count >=
+		    tap_lag_limit(pdata, tap))
+			tap_drop_oldest(pdata, tap);
+
+		entry = &tap->pending[(tap->pending_head + tap->pending_count) %
+				      VB2_MAX_FRAME];
+		*entry = buf->tap_info;
+		tap->pending_count++;
+		buf->taps++;
+		wake_up_interruptible(&tap->wait);
+	}
+}
+
+/*
+ * Forget everything the taps hold, the buffers are back to vb2, and wake
+ * the taps waiting in tap_get() for a buffer that will not come.
+ */
+static void taps_reset(struct psee_video *pdata)
+{
+	struct psee_buffer *buf;
+	struct psee_tap *tap;
+	struct vb2_buffer *vb;
+	unsigned long flags;
+	unsigned int i;
+
+	spin_lock_irqsave(&pdata->qlock, flags);
+	list_for_each_entry(tap, &pdata->taps, list) {
+		tap->pending_count = 0;
+		bitmap_zero(tap->held, VB2_MAX_FRAME);
+		tap->held_count = 0;
+		wake_up_interruptible(&tap->wait);
+	}
+	for (i = 0; i < VB2_MAX_FRAME; i++) {
+		vb = vb2_get_buffer(&pdata->queue, i);
+		if (!vb)
+			continue;
+		buf = to_psee_buffer(vb);
+		buf->taps = 0;
+		buf->parked = false;
+	}
+	spin_unlock_irqrestore(&pdata->qlock, flags);
+}
+
+static struct psee_tap *find_tap(struct psee_video *pdata, struct file *file)
+{
+	struct psee_tap *tap;
+
+	list_for_each_entry(tap, &pdata->taps, list)
+		if (tap->file == file)
+			return tap;
+	return NULL;
+}
+
+/* Called with pdata->lock held */
+static int tap_attach(struct file *file, struct psee_tap_attach *attach)
+{
+	struct psee_video *pdata = video_drvdata(file);
+	struct psee_tap *tap;
+	unsigned long flags;
+
+	/* the owner gets the buffers through DQBUF */
+	if (pdata->queue.owner == file->private_data)
+		return -EBUSY;
+
+	tap = kzalloc(sizeof(*tap), GFP_KERNEL);
+	if (!tap)
+		return -ENOMEM;
+
+	tap->file = file;
+	tap->max_lag = attach->max_lag ? attach->max_lag : TAP_DEFAULT_MAX_LAG;
+	tap->max_lag = clamp_t(unsigned int, tap->max_lag, 1, VB2_MAX_FRAME);
+	init_waitqueue_head(&tap->wait);
+
+	spin_lock_irqsave(&pdata->qlock, flags);
+	if (find_tap(pdata, file)) {
+		spin_unlock_irqrestore(&pdata->qlock, flags);
+		kfree(tap);
+		return -EBUSY;
+	}
+	list_add_tail(&tap->list, &pdata->taps);
+	spin_unlock_irqrestore(&pdata->qlock, flags);
+
+	return 0;
+}
+
+/*
+ * Hand the oldest pending buffer to the tap. Called with pdata->lock held,
+ * which is dropped while waiting, as vb2 does for DQBUF. As DQBUF, fails
+ * with -EINVAL when not streaming.
+ */
+static int tap_get(struct file *file, struct psee_tap_buffer *out)
+{
+	struct psee_video *pdata = video_drvdata(file);
+	struct psee_tap *tap;
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&pdata->qlock, flags);
+	tap = find_tap(pdata, file);
+	if (!tap) {
+		spin_unlock_irqrestore(&pdata->qlock, flags);
+		return -EINVAL;
+	}
+
+	while (!tap->pending_count) {
+		if (!pdata->streaming) {
+			spin_unlock_irqrestore(&pdata->qlock, flags);
+			return -EINVAL;
+		}
+		spin_unlock_irqrestore(&pdata->qlock, flags);
+
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		/* the tap lives until its file is released */
+		mutex_unlock(&pdata->lock);
+		ret = wait_event_interruptible(tap->wait,
+					       READ_ONCE(tap->pending_count) ||
+					       !READ_ONCE(pdata->streaming));
+		mutex_lock(&pdata->lock);
+		if (ret)
+			return ret;
+
+		spin_lock_irqsave(&pdata->qlock, flags);
+	}
+
+	*out = tap->pending[tap->pending_head];
+	out->dropped = tap->dropped;
+	tap->pending_head = (tap->pending_head + 1) % VB2_MAX_FRAME;
+	tap->pending_count--;
+	set_bit(out->index, tap->held);
+	tap->held_sequence[out->index] = out->sequence;
+	tap->held_count++;
+	spin_unlock_irqrestore(&pdata->qlock, flags);
+
+	return 0;
+}
+
+static int tap_put(struct file *file, struct psee_tap_buffer *in)
+{
+	struct psee_video *pdata = video_drvdata(file);
+	struct psee_tap *tap;
+	unsigned long flags;
+	int ret = 0;
+
+	if (in->index >= VB2_MAX_FRAME)
+		return -EINVAL;
+
+	spin_lock_irqsave(&pdata->qlock, flags);
+	tap = find_tap(pdata, file);
+	if (!tap) {
+		ret = -EINVAL;
+	} else if (!test_bit(in->index, tap->held) ||
+		   in->sequence != tap->held_sequence[in->index]) {
+		/*
+		 * Dropped because the tap was lagging, the index may even
+		 * have been handed out again since.
+		 */
+		ret = -ENOENT;
+	} else {
+		clear_bit(in->index, tap->held);
+		tap->held_count--;
+		tap_unref(pdata, in->index);
+	}
+	spin_unlock_irqrestore(&pdata->qlock, flags);
+
+	return ret;
+}
+
+/* Detach the tap of a closing file, releasing all it still holds */
+static void tap_release(struct file *file)
+{
+	struct psee_video *pdata = video_drvdata(file);
+	struct psee_tap *tap;
+	unsigned long flags;
+	unsigned int i;
+
+	spin_lock_irqsave(&pdata->qlock, flags);
+	tap = find_tap(pdata, file);
+	if (!tap) {
+		spin_unlock_irqrestore(&pdata->qlock, flags);
+		return;
+	}
+
+	list_del(&tap->list);
+	for (; tap->pending_count; tap->pending_count--) {
+		tap_unref(pdata, tap->pending[tap->pending_head].index);
+		tap->pending_head = (tap->pending_head + 1) % VB2_MAX_FRAME;
+	}
+	for_each_set_bit(i, tap->held, VB2_MAX_FRAME)
+		tap_unref(pdata, i);
+	spin_unlock_irqrestore(&pdata->qlock, flags);
+
+	kfree(tap);
+}
+
+/* Returns false if this file is not a tap */
+static bool tap_poll(struct file *file, struct poll_table_struct *wait,
+		     __poll_t *res)
+{
+	struct psee_video *pdata = video_drvdata(file);
+	struct psee_tap *tap;
+	unsigned long flags;
+
+	spin_lock_irqsave(&pdata->qlock, flags);
+	tap = find_tap(pdata, file);
+	spin_unlock_irqrestore(&pdata->qlock, flags);
+	if (!tap)
+		return false;
+
+	poll_wait(file, &tap->wait, wait);
+	if (READ_ONCE(tap->pending_count))
+		*res = EPOLLIN | EPOLLRDNORM;
+	else
+		*res = READ_ONCE(pdata->streaming) ? 0 : EPOLLERR;
+
+	return true;
+}
+
+static int psee_video_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct psee_video *pdata = video_drvdata(file);
+	unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
+
+	if (offset == PSEE_RING_CTRL_OFFSET || offset == PSEE_RING_DATA_OFFSET)
+		return ring_mmap(file, vma);
+
+	/* only the queue owner may map the capture buffers writable */
+	if (pdata->queue.owner != file->private_data) {
+		if (vma->vm_flags & VM_WRITE)
+			return -EACCES;
+		vm_flags_clear(vma, VM_MAYWRITE);
+	}
+
+	return vb2_fop_mmap(file, vma);
+}
+
+/*
+ * Readable once there is data past data_tail, including for read() the
+ * part of the period being written: after a partial read() data_tail is
+ * ahead of data_head. A stopped ring is readable, read() returns what is
+ * left then end of file, and hung up.
+ */
+static __poll_t ring_poll(struct file *file, struct poll_table_struct *wait)
+{
+	struct psee_video *pdata = video_drvdata(file);
+	struct psee_ring *ring = &pdata->ring;
+	__poll_t res = 0;
+	u64 head;
+
+	poll_wait(file, &ring->wait, wait);
+
+	mutex_lock(&ring->lock);
+	if (ring->ctrl) {
+		head = smp_load_acquire(&ring->ctrl->data_head);
+		if (READ_ONCE(ring->reader))
+			head = ring_current_head(pdata, head);
+		if (head > READ_ONCE(ring->ctrl->data_tail))
+			res |= EPOLLIN | EPOLLRDNORM;
+		if (!ring->running)
+			res |= EPOLLIN | EPOLLRDNORM | EPOLLHUP;
+	}
+	mutex_unlock(&ring->lock);
+
+	return res;
+}
+
+/*
+ * As vb2 did for its read() emulation, polling an idle handle for input
+ * starts the capture read() is served from. Returns true if this file
+ * owns the ring now.
+ */
+static bool ring_poll_start(struct file *file, struct poll_table_struct *wait)
+{
+	struct psee_video *pdata = video_drvdata(file);
+	struct psee_ring_config cfg = { };
+	bool started;
+
+	if (!(poll_requested_events(wait) & (EPOLLIN | EPOLLRDNORM)))
+		return false;
+
+	mutex_lock(&pdata->lock);
+	started = pdata->ring.owner == file || !ring_start(file, &cfg);
+	if (started)
+		WRITE_ONCE(pdata->ring.reader, true);
+	mutex_unlock(&pdata->lock);
+
+	return started;
+}
+
+static __poll_t psee_video_poll(struct file *file,
+				struct poll_table_struct *wait)
+{
+	struct psee_video *pdata = video_drvdata(file);
+	struct v4l2_fh *fh = file->private_data;
+	__poll_t res;
+
+	/* neither a ring nor a tap, and the ring could not be started */
+	if (READ_ONCE(pdata->ring.owner) != file &&
+	    !tap_poll(file, wait, &res) && !ring_poll_start(file, wait))
+		return vb2_fop_poll(file, wait);
+
+	if (READ_ONCE(pdata->ring.owner) == file)
+		res = ring_poll(file, wait);
+
+	poll_wait(file, &fh->wait, wait);
+	if (v4l2_event_pending(fh))
+		res |= EPOLLPRI;
+
+	return res;
+}
+
 static int psee_video_open(struct file *file)
 {
 	struct psee_video *pdata = video_drvdata(file);
@@ -360,6 +1297,9 @@ static int psee_video_release(struct file *file)
 	/* Save the singular status before we call the clean-up helper */
 	fh_singular = v4l2_fh_is_singular_file(file);
 
+	ring_release(file);
+	tap_release(file);
+
 	/* the release helper will cleanup any on-going streaming */
 	ret = _vb2_fop_release(file, NULL);
 
@@ -403,9 +1343,10 @@ static const struct v4l2_file_operations psee_video_fops = {
 	.open		= psee_video_open,
 	.release	= psee_video_release,
 	.unlocked_ioctl	= video_ioctl2,
-	.poll		= vb2_fop_poll,
-	.mmap		= vb2_fop_mmap,
-	.read		= vb2_fop_read,
+	.poll		= psee_video_poll,
+	.mmap		= psee_video_mmap,
+	/* no splice: the v4l2 core has no hook for it, see psee-video.h */
+	.read		= psee_video_read,
 };
 
 static int psee_querycap(struct file *file, void *priv,
@@ -448,6 +1389,46 @@ static int psee_s_input(struct file *file, void *priv, unsigned int i)
 	return 0;
 }
 
+static int psee_subscribe_event(struct v4l2_fh *fh,
+				const struct v4l2_event_subscription *sub)
+{
+	switch (sub->type) {
+	case V4L2_EVENT_PSEE_DMA_RECOVERY:
+		return v4l2_event_subscribe(fh, sub, 4, NULL);
+	default:
+		return -EINVAL;
+	}
+}
+
+static long psee_video_default(struct file *file, void *fh, bool valid_prio,
+			       unsigned int cmd, void *arg)
+{
+	struct psee_video *pdata = video_drvdata(file);
+	struct psee_ring *ring = &pdata->ring;
+	int ret = 0;
+
+	switch (cmd) {
+	case PSEE_IOC_RING_START:
+		return ring_start(file, arg);
+	case PSEE_IOC_RING_STOP:
+		mutex_lock(&ring->lock);
+		if (ring->owner == file)
+			ring_stop(pdata);
+		else
+			ret = -EBUSY;
+		mutex_unlock(&ring->lock);
+		return ret;
+	case PSEE_IOC_TAP_ATTACH:
+		return tap_attach(file, arg);
+	case PSEE_IOC_TAP_GET:
+		return tap_get(file, arg);
+	case PSEE_IOC_TAP_PUT:
+		return tap_put(file, arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
 static const struct v4l2_ioctl_ops psee_video_ioctl_ops = {
 	.vidioc_querycap		= psee_querycap,
 	.vidioc_try_fmt_vid_cap		= psee_try_fmt_vid_cap,
@@ -468,6 +1449,11 @@ static const struct v4l2_ioctl_ops psee_video_ioctl_ops = {
 	.vidioc_prepare_buf		= vb2_ioctl_prepare_buf,
 	.vidioc_streamon		= vb2_ioctl_streamon,
 	.vidioc_streamoff		= vb2_ioctl_streamoff,
+
+	.vidioc_subscribe_event		= psee_subscribe_event,
+	.vidioc_unsubscribe_event	= v4l2_event_unsubscribe,
+
+	.vidioc_default			= psee_video_default,
 };
 
 /*
@@ -481,6 +1467,12 @@ static int queue_setup(struct vb2_queue *vq,
 		       unsigned int *nbuffers, unsigned int *nplanes,
 		       unsigned int sizes[], struct device *alloc_devs[])
 {
+	struct psee_video *pdata = vb2_get_drv_priv(vq);
+
+	/* the ring capture owns the DMA channel */
+	if (READ_ONCE(pdata->ring.running))
+		return -EBUSY;
+
 	if (*nplanes)
 		return sizes[0] < SIZE_IMAGE ? -EINVAL : 0;
 	*nplanes = 1;
@@ -497,6 +1489,28 @@ static int buf_init(struct vb2_buffer *vb)
 	return 0;
 }
 
+/*
+ * Non-coherent (cacheable) buffers are only offered for MMAP, as requested
+ * with V4L2_MEMORY_FLAG_NON_COHERENT at REQBUFS/CREATE_BUFS time, on 5.16
+ * or later. They come from dma_alloc_noncontiguous(), and the driver only
+ * takes over their CPU side sync when that is a single physically
+ * contiguous chunk, see psee_video_probe().
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+static inline bool is_payload_synced(struct vb2_buffer *vb)
+{
+	struct psee_video *pdata = vb2_get_drv_priv(vb->vb2_queue);
+
+	return pdata->payload_sync && vb->vb2_queue->non_coherent_mem &&
+	       vb->memory == VB2_MEMORY_MMAP;
+}
+#else
+static inline bool is_payload_synced(struct vb2_buffer *vb)
+{
+	return false;
+}
+#endif
+
 /*
  * Prepare the buffer for queueing to the DMA engine: check and set the
  * payload size.
@@ -511,98 +1525,401 @@ static int buffer_prepare(struct vb2_buffer *vb)
 		return -EINVAL;
 	}
 
+	/*
+	 * vb2 still invalidates the whole buffer for the device, since the
+	 * DMA may write anywhere in it, but the CPU side invalidation is done
+	 * in buffer_sync_for_cpu() and limited to what the DMA actually wrote.
+	 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+	if (is_payload_synced(vb))
+		vb->skip_cache_sync_on_finish = 1;
+#endif
+
 	vb2_set_plane_payload(vb, 0, SIZE_IMAGE);
 	return 0;
 }
 
-static void dma_callback(void *param)
+/*
+ * Hand a non-coherent buffer back to the CPU: only the payload reported by
+ * complete_buffers() needs to be invalidated, which is usually a fraction
+ * of the buffer. Done on completion, where vb2 syncs the other buffers, so
+ * that the taps never read stale cache lines. Safe in atomic context: with
+ * no IOMMU the kernel mapping is the linear one, nothing gets vmapped.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+static void buffer_sync_for_cpu(struct vb2_buffer *vb)
+{
+	unsigned long payload = vb2_get_plane_payload(vb, 0);
+	void *vaddr;
+
+	if (!is_payload_synced(vb) || !payload)
+		return;
+
+	dma_sync_single_for_cpu(vb->vb2_queue->dev,
+				vb2_dma_contig_plane_dma_addr(vb, 0),
+				payload, DMA_FROM_DEVICE);
+
+	/* as vb2_dc_finish() does for a kernel mapping of the buffer */
+	vaddr = vb2_plane_vaddr(vb, 0);
+	if (vaddr)
+		invalidate_kernel_vmap_range(vaddr, payload);
+}
+#else
+static inline void buffer_sync_for_cpu(struct vb2_buffer *vb)
+{
+}
+#endif
+
+/*
+ * Called with qlock held when the DMA reports anything but progress or
+ * completion: the channel is restarted from process context, see
+ * recovery_work().
+ */
+static void schedule_recovery(struct psee_video *pdata, enum dma_status status)
+{
+	if (!pdata->streaming || pdata->recovering)
+		return;
+
+	pdata->recovering = true;
+	pdata->recovery_status = status;
+	pdata->fault_time = ktime_get();
+	schedule_work(&pdata->recovery_work);
+}
+
+static inline ktime_t coalesce_delay(struct psee_video *pdata)
+{
+	return us_to_ktime((u64)max(READ_ONCE(irq_coalesce_us), 1u) <<
+			   pdata->coalesce_backoff);
+}
+
+/*
+ * Called with qlock held: hand a buffer the DMA is done with to vb2, then to
+ * the taps. What the taps get is taken beforehand, as the owner may dequeue
+ * and prepare the buffer again as soon as vb2 has it. It cannot requeue it
+ * before the taps got it though, buffer_queue() waits for qlock.
+ */
+static void retire_buffer(struct psee_video *pdata, struct psee_buffer *buf,
+			  enum vb2_buffer_state state)
+{
+	list_del_init(&buf->list);
+	buffer_sync_for_cpu(&buf->vb.vb2_buf);
+
+	buf->tap_info.index = buf->vb.vb2_buf.index;
+	buf->tap_info.sequence = buf->vb.sequence;
+	buf->tap_info.bytesused = vb2_get_plane_payload(&buf->vb.vb2_buf, 0);
+	buf->tap_info.timestamp_ns = buf->vb.vb2_buf.timestamp;
+
+	dev_dbg(pdata->mdev.dev, "buffer[%d] done seq=%d\n",
+		buf->vb.vb2_buf.index, buf->vb.sequence);
+	vb2_buffer_done(&buf->vb.vb2_buf, state);
+
+	/* synced for the CPU by now, by either of the above */
+	if (state == VB2_BUF_STATE_DONE)
+		tap_publish(pdata, buf);
+}
+
+/*
+ * Retire, in queueing order, every buffer the DMA is done with. With
+ * interrupt coalescing only some descriptors raise a callback, so a single
+ * call may complete several buffers. The completion time of a buffer with
+ * no interrupt is unknown, all the buffers retired by a call get its time.
+ *
+ * The DMA callback and the coalescing timer may both get here at once on
+ * two CPUs: buffers are handed to vb2 and to the taps under qlock, so that
+ * they always get them in sequence order.
+ *
+ * Each retirement pushes the coalescing timer back by irq_coalesce_us if
+ * buffers with no interrupting descriptor behind them are still in flight,
+ * so that it only fires once interrupts stopped coming.
+ *
+ * Returns true if such buffers are in flight but none could be retired.
+ */
+static bool complete_buffers(struct psee_video *pdata)
 {
-	struct psee_buffer *buf = (struct psee_buffer *)param;
-	struct psee_video *pdata = vb2_get_drv_priv(buf->vb.vb2_buf.vb2_queue);
+	struct psee_buffer *buf, *node;
 	struct dma_tx_state state;
 	enum dma_status status;
 	unsigned long flags;
+	bool retired = false;
+	bool stalled;
+	u64 now;
 
 	spin_lock_irqsave(&pdata->qlock, flags);
 
-	/* Check DMA status */
-	status = dmaengine_tx_status(pdata->chan[OUT], buf->dma_cookie, &state);
-
-	switch (status) {
-	case DMA_IN_PROGRESS:
-		dev_dbg(pdata->mdev.dev, "%s: Received DMA_IN_PROGRESS\n", __func__);
-		break;
-	case DMA_PAUSED:
-		dev_err(pdata->mdev.dev, "%s: Received DMA_PAUSED\n", __func__);
-		break;
-	case DMA_ERROR:
-		dev_err(pdata->mdev.dev, "%s: Received DMA_ERROR\n", __func__);
-		/* Return buffer to V4L2 in error state */
-		/* no break */
-	case DMA_COMPLETE:
-		dev_dbg(pdata->mdev.dev, "%s: Received DMA_COMPLETE\n", __func__);
-
-		/* Return buffer to V4L2 */
-		list_del_init(&buf->list);
-		buf->vb.sequence = pdata->sequence++;
-		buf->vb.field = V4L2_FIELD_NONE;
-		buf->vb.vb2_buf.timestamp = ktime_get_ns();
-		vb2_set_plane_payload(&buf->vb.vb2_buf, 0, SIZE_IMAGE - state.residue);
-		vb2_buffer_done(&buf->vb.vb2_buf,
-			(status == DMA_COMPLETE) ? VB2_BUF_STATE_DONE : VB2_BUF_STATE_ERROR);
-		dev_dbg(pdata->mdev.dev, "buffer[%d] done seq=%d\n",
-			buf->vb.vb2_buf.index, buf->vb.sequence);
-		break;
-	default:
-		dev_err(pdata->mdev.dev, "%s: Received unknown status\n", __func__);
-		break;
+	now = ktime_get_ns();
+	list_for_each_entry_safe(buf, node, &pdata->buffers, list) {
+		/* the list is being resubmitted, cookies are stale */
+		if (pdata->recovering)
+			break;
+
+		/* Check DMA status */
+		status = dmaengine_tx_status(pdata->chan[OUT], buf->dma_cookie, &state);
+
+		switch (status) {
+		case DMA_IN_PROGRESS:
+			dev_dbg(pdata->mdev.dev, "%s: Received DMA_IN_PROGRESS\n", __func__);
+			goto unlock;
+		case DMA_PAUSED:
+			dev_err(pdata->mdev.dev, "%s: Received DMA_PAUSED\n", __func__);
+			schedule_recovery(pdata, status);
+			goto unlock;
+		case DMA_ERROR:
+			dev_err(pdata->mdev.dev, "%s: Received DMA_ERROR\n", __func__);
+			schedule_recovery(pdata, status);
+			/* Return buffer to V4L2 in error state */
+			fallthrough;
+		case DMA_COMPLETE:
+			dev_dbg(pdata->mdev.dev, "%s: Received DMA_COMPLETE\n", __func__);
+			if (status == DMA_COMPLETE)
+				pdata->failed_recoveries = 0;
+
+			/* Return buffer to V4L2 */
+			buf->vb.sequence = pdata->sequence++;
+			buf->vb.field = V4L2_FIELD_NONE;
+			buf->vb.vb2_buf.timestamp = now;
+			vb2_set_plane_payload(&buf->vb.vb2_buf, 0, SIZE_IMAGE - state.residue);
+			retire_buffer(pdata, buf, (status == DMA_COMPLETE) ?
+				      VB2_BUF_STATE_DONE : VB2_BUF_STATE_ERROR);
+			retired = true;
+			break;
+		default:
+			dev_err(pdata->mdev.dev, "%s: Received unknown status\n", __func__);
+			schedule_recovery(pdata, status);
+			goto unlock;
+		}
+
+		/* the rest of the list is resubmitted by the recovery */
+		if (status == DMA_ERROR)
+			break;
 	}
 
+unlock:
+	if (list_empty(&pdata->buffers))
+		pdata->since_irq = 0;
+	stalled = pdata->since_irq && !retired;
+	if (retired) {
+		pdata->coalesce_backoff = 0;
+		if (pdata->since_irq)
+			hrtimer_start(&pdata->coalesce_timer,
+				      coalesce_delay(pdata),
+				      HRTIMER_MODE_REL_SOFT);
+		else
+			hrtimer_try_to_cancel(&pdata->coalesce_timer);
+	}
 	spin_unlock_irqrestore(&pdata->qlock, flags);
+
+	return stalled;
+}
+
+static void dma_callback(void *param)
+{
+	complete_buffers((struct psee_video *)param);
 }
 
 /*
- * Queue this buffer to the DMA engine.
+ * Coalescing fallback: retires the buffers whose descriptors did not raise
+ * an interrupt, irq_coalesce_us after the last retirement. While the DMA is
+ * still filling such a buffer, e.g. with an idle sensor, the polling period
+ * doubles up to 2^COALESCE_MAX_BACKOFF times irq_coalesce_us.
  */
-static void buffer_queue(struct vb2_buffer *vb)
+static enum hrtimer_restart coalesce_timer(struct hrtimer *timer)
 {
-	struct psee_video *pdata = vb2_get_drv_priv(vb->vb2_queue);
-	struct psee_buffer *buf = to_psee_buffer(vb);
+	struct psee_video *pdata = container_of(timer, struct psee_video,
+						coalesce_timer);
 	unsigned long flags;
-	struct dma_async_tx_descriptor *desc = NULL;
 
+	/* a retirement re-armed the timer if needed */
+	if (!complete_buffers(pdata))
+		return HRTIMER_NORESTART;
+
+	/* the timer is only ever armed under qlock, see submit_buffer() */
 	spin_lock_irqsave(&pdata->qlock, flags);
-	list_add_tail(&buf->list, &pdata->buffers);
+	if (pdata->since_irq && !hrtimer_is_queued(timer)) {
+		if (pdata->coalesce_backoff < COALESCE_MAX_BACKOFF)
+			pdata->coalesce_backoff++;
+		hrtimer_start(timer, coalesce_delay(pdata),
+			      HRTIMER_MODE_REL_SOFT);
+	}
+	spin_unlock_irqrestore(&pdata->qlock, flags);
+
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Submit a DMA transaction for this buffer. Must be called with qlock held,
+ * the caller is responsible for issuing the pending transactions.
+ */
+static int submit_buffer(struct psee_video *pdata, struct psee_buffer *buf)
+{
+	struct dma_async_tx_descriptor *desc = NULL;
+	bool irq = pdata->since_irq + 1 >= max(READ_ONCE(irq_coalesce), 1u);
 
 	/* Prepare a DMA transaction */
 	desc = dmaengine_prep_slave_single(pdata->chan[OUT],
 			vb2_dma_contig_plane_dma_addr(&buf->vb.vb2_buf, 0),
 			vb2_plane_size(&buf->vb.vb2_buf, 0),
 			DMA_DEV_TO_MEM,
-			DMA_PREP_INTERRUPT);
+			irq ? DMA_PREP_INTERRUPT : 0);
 	if (!desc) {
 		dev_err(pdata->mdev.dev, "%s: DMA prep_single failed: phy=%llu size=%zu\n",
 			__func__,
 			vb2_dma_contig_plane_dma_addr(&buf->vb.vb2_buf, 0),
 			vb2_plane_size(&buf->vb.vb2_buf, 0));
-		goto release_spinlock;
+		return -ENOMEM;
 	}
 
-	/* Set completion callback routine for notification */
-	desc->callback = dma_callback;
-	desc->callback_param = buf;
+	/*
+	 * Set completion callback routine for notification. Only interrupting
+	 * descriptors get one, it retires all the buffers completed before.
+	 */
+	if (irq) {
+		desc->callback = dma_callback;
+		desc->callback_param = pdata;
+	}
 
 	/* Push current DMA transaction in the pending queue */
 	buf->dma_cookie = dmaengine_submit(desc);
 	if (dma_submit_error(buf->dma_cookie)) {
 		dev_err(pdata->mdev.dev, "%s: DMA submission failed\n", __func__);
-		goto release_spinlock;
+		return -EIO;
+	}
+
+	/*
+	 * A buffer with no interrupt behind it arms the coalescing timer,
+	 * unless a retirement already did it.
+	 */
+	if (irq) {
+		pdata->since_irq = 0;
+	} else {
+		pdata->since_irq++;
+		if (!hrtimer_is_queued(&pdata->coalesce_timer))
+			hrtimer_start(&pdata->coalesce_timer,
+				      coalesce_delay(pdata),
+				      HRTIMER_MODE_REL_SOFT);
+	}
+
+	return 0;
+}
+
+/*
+ * Called with qlock held for a buffer the DMA could not be given. Left in
+ * the list, complete_buffers() would take its stale cookie for a completed
+ * transfer: it is handed back in error and with no payload instead.
+ */
+static void fail_buffer(struct psee_video *pdata, struct psee_buffer *buf)
+{
+	list_del_init(&buf->list);
+	vb2_set_plane_payload(&buf->vb.vb2_buf, 0, 0);
+	vb2_buffer_done(&buf->vb.vb2_buf, VB2_BUF_STATE_ERROR);
+}
+
+/* Called with qlock held */
+static void queue_to_dma(struct psee_video *pdata, struct psee_buffer *buf)
+{
+	list_add_tail(&buf->list, &pdata->buffers);
+
+	/* while recovering, the channel is restarted with the whole list */
+	if (pdata->recovering)
+		return;
+
+	if (submit_buffer(pdata, buf))
+		fail_buffer(pdata, buf);
+	else
+		dma_async_issue_pending(pdata->chan[OUT]);
+}
+
+/*
+ * Queue this buffer to the DMA engine, or park it until the taps still
+ * reading it are done.
+ */
+static void buffer_queue(struct vb2_buffer *vb)
+{
+	struct psee_video *pdata = vb2_get_drv_priv(vb->vb2_queue);
+	struct psee_buffer *buf = to_psee_buffer(vb);
+	unsigned long flags;
+
+	spin_lock_irqsave(&pdata->qlock, flags);
+	if (buf->taps) {
+		buf->parked = true;
+		list_add_tail(&buf->list, &pdata->parked);
+		tap_reclaim(pdata);
+	} else {
+		queue_to_dma(pdata, buf);
+	}
+	spin_unlock_irqrestore(&pdata->qlock, flags);
+}
+
+/*
+ * Reset the FPGA output FIFO and packetizer, leaving the sensor and the rest
+ * of the datapath alone. These are the output stage writes of
+ * stop_streaming() and start_streaming().
+ */
+static void reset_output_path(struct psee_video *pdata)
+{
+	write_reg(pdata, 0x0020C000, 0x00000002);
+	write_reg(pdata, 0x00209028, 0x00000002);
+	write_reg(pdata, 0x00209028, 0x00000000);
+	write_reg(pdata, 0x0020C000, 0x00000005);
+}
+
+/*
+ * Recover from a DMA error without going through a full stream restart:
+ * stop the channel, reset the FPGA output path and resubmit all buffers
+ * still queued to the driver. Gives up and flags the queue in error after
+ * MAX_DMA_RECOVERIES attempts with no buffer completed in between, so the
+ * capture gap stays bounded.
+ */
+static void recovery_work(struct work_struct *work)
+{
+	struct psee_video *pdata = container_of(work, struct psee_video,
+						recovery_work);
+	struct psee_event_dma_recovery *info;
+	struct v4l2_event ev = {
+		.type = V4L2_EVENT_PSEE_DMA_RECOVERY,
+	};
+	struct psee_buffer *buf, *node;
+	unsigned long flags;
+	u64 gap_ns;
+
+	dmaengine_terminate_sync(pdata->chan[OUT]);
+	reset_output_path(pdata);
+
+	spin_lock_irqsave(&pdata->qlock, flags);
+	if (!pdata->streaming) {
+		pdata->recovering = false;
+		spin_unlock_irqrestore(&pdata->qlock, flags);
+		return;
+	}
+
+	if (++pdata->failed_recoveries > MAX_DMA_RECOVERIES) {
+		pdata->recovering = false;
+		spin_unlock_irqrestore(&pdata->qlock, flags);
+		dev_err(pdata->mdev.dev, "%s: DMA keeps failing, giving up\n",
+			__func__);
+		vb2_queue_error(&pdata->queue);
+		return;
 	}
 
+	list_for_each_entry_safe(buf, node, &pdata->buffers, list)
+		if (submit_buffer(pdata, buf))
+			fail_buffer(pdata, buf);
 	dma_async_issue_pending(pdata->chan[OUT]);
 
-release_spinlock:
+	pdata->recovering = false;
+	gap_ns = ktime_to_ns(ktime_sub(ktime_get(), pdata->fault_time));
+	pdata->max_gap_ns = max(pdata->max_gap_ns, gap_ns);
+	pdata->recoveries++;
+
+	info = (struct psee_event_dma_recovery *)ev.u.data;
+	info->count = pdata->recoveries;
+	info->status = pdata->recovery_status;
+	info->gap_ns = gap_ns;
+	info->max_gap_ns = pdata->max_gap_ns;
 	spin_unlock_irqrestore(&pdata->qlock, flags);
+
+	dev_warn(pdata->mdev.dev, "DMA recovered (#%u) after %llu us\n",
+		 info->count, div_u64(gap_ns, NSEC_PER_USEC));
+	v4l2_event_queue(&pdata->vdev, &ev);
 }
 
 static void return_all_buffers(struct psee_video *pdata,
@@ -616,6 +1933,10 @@ static void return_all_buffers(struct psee_video *pdata,
 		vb2_buffer_done(&buf->vb.vb2_buf, state);
 		list_del(&buf->list);
 	}
+	list_for_each_entry_safe(buf, node, &pdata->parked, list) {
+		vb2_buffer_done(&buf->vb.vb2_buf, state);
+		list_del(&buf->list);
+	}
 	spin_unlock_irqrestore(&pdata->qlock, flags);
 }
 
@@ -628,22 +1949,25 @@ static void return_all_buffers(struct psee_video *pdata,
 static int start_streaming(struct vb2_queue *vq, unsigned int count)
 {
 	struct psee_video *pdata = vb2_get_drv_priv(vq);
+	unsigned long flags;
 	int ret = 0;
 
 	pdata->sequence = 0;
 
-	write_reg(pdata, 0x0010F000, 0x00400001);
-	write_reg(pdata, 0x0020B000, 0x00000159);
-	write_reg(pdata, 0x00209028, 0x00000000);
-	write_reg(pdata, 0x00209008, 0x00000645);
-	write_reg(pdata, 0x0020002C, 0x0022C724);
-	write_reg(pdata, 0x00200004, 0xF0005442);
+	spin_lock_irqsave(&pdata->qlock, flags);
+	pdata->streaming = true;
+	pdata->recovering = false;
+	pdata->failed_recoveries = 0;
+	spin_unlock_irqrestore(&pdata->qlock, flags);
+
+	enable_output(pdata);
 
 	if (ret) {
 		/*
 		 * In case of an error, return all active buffers to the
 		 * QUEUED state
 		 */
+		pdata->streaming = false;
 		return_all_buffers(pdata, VB2_BUF_STATE_QUEUED);
 	}
 	return ret;
@@ -656,17 +1980,28 @@ static int start_streaming(struct vb2_queue *vq, unsigned int count)
 static void stop_streaming(struct vb2_queue *vq)
 {
 	struct psee_video *pdata = vb2_get_drv_priv(vq);
+	unsigned long flags;
 
-	write_reg(pdata, 0x00200004, 0xF0005042);
-	write_reg(pdata, 0x0020002C, 0x0022C324);
-	write_reg(pdata, 0x0020C000, 0x00000002);
-	write_reg(pdata, 0x00209028, 0x00000002);
-	write_reg(pdata, 0x0020C000, 0x00000005);
-	write_reg(pdata, 0x00209008, 0x00000644);
+	/* no recovery may restart the DMA behind our back from now on */
+	spin_lock_irqsave(&pdata->qlock, flags);
+	pdata->streaming = false;
+	spin_unlock_irqrestore(&pdata->qlock, flags);
+	cancel_work_sync(&pdata->recovery_work);
+	/* a recovery cancelled before it ran did not clear it */
+	spin_lock_irqsave(&pdata->qlock, flags);
+	pdata->recovering = false;
+	spin_unlock_irqrestore(&pdata->qlock, flags);
+
+	disable_output(pdata);
 	dmaengine_terminate_sync(pdata->chan[OUT]);
+	/* no DMA callback may re-arm it from now on */
+	hrtimer_cancel(&pdata->coalesce_timer);
 
 	/* Release all active buffers */
 	return_all_buffers(pdata, VB2_BUF_STATE_ERROR);
+	taps_reset(pdata);
+	pdata->since_irq = 0;
+	pdata->coalesce_backoff = 0;
 }
 
 static const struct vb2_ops psee_qops = {
@@ -715,6 +2050,16 @@ static int psee_video_probe(struct platform_device *pdev)
 		return -ENODEV;
 	}
 
+	/*
+	 * Optional dedicated pool for the capture buffers, which then do not
+	 * compete with other drivers in the global CMA area.
+	 */
+	rc = of_reserved_mem_device_init(dev);
+	if (rc && rc != -ENODEV) {
+		dev_err(dev, "Could not attach memory-region (%d)\n", rc);
+		return rc;
+	}
+
 	mutex_init(&pdata->lock);
 
 	media_device_init(&pdata->mdev);
@@ -745,19 +2090,46 @@ static int psee_video_probe(struct platform_device *pdev)
 
 	/* for the DMA engine */
 	INIT_LIST_HEAD(&pdata->buffers);
+	INIT_LIST_HEAD(&pdata->parked);
+	INIT_LIST_HEAD(&pdata->taps);
 	spin_lock_init(&pdata->qlock);
+	INIT_WORK(&pdata->recovery_work, recovery_work);
+	mutex_init(&pdata->ring.lock);
+	init_waitqueue_head(&pdata->ring.wait);
+	hrtimer_init(&pdata->coalesce_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+	pdata->coalesce_timer.function = coalesce_timer;
 
 	/* buffer queue */
 	pdata->queue.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	pdata->queue.io_modes = VB2_MMAP | VB2_READ | VB2_DMABUF;
+	/*
+	 * USERPTR lets recorders capture into their own (hugetlb) memory, which
+	 * unlike our mmapped buffers can be written to disk with O_DIRECT.
+	 * read() is served by the ring capture, not by vb2's file I/O emulation.
+	 */
+	pdata->queue.io_modes = VB2_MMAP | VB2_USERPTR | VB2_DMABUF;
 	pdata->queue.lock = &pdata->lock;
 	pdata->queue.drv_priv = pdata;
 	pdata->queue.buf_struct_size = sizeof(struct psee_buffer);
 	pdata->queue.ops = &psee_qops;
 	pdata->queue.mem_ops = &vb2_dma_contig_memops;
 	pdata->queue.timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
-	/* issues were seen below 4 buffers, to be investigated */
-	pdata->queue.min_buffers_needed = 4;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+	/* let userspace ask for cacheable buffers and do its own cache hints */
+	pdata->queue.allow_cache_hints = 1;
+	/*
+	 * Behind an IOMMU non-coherent buffers are scattered in physical
+	 * memory and only vb2's scatterlist sync covers them, as it does for
+	 * the DMA API debug checks, which track them as scatterlists.
+	 */
+	pdata->payload_sync = !device_iommu_mapped(dev) &&
+			      !IS_ENABLED(CONFIG_DMA_API_DEBUG);
+#endif
+	/* renamed in 6.9 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 9, 0)
+	pdata->queue.min_buffers_needed = MIN_BUFFERS_NEEDED;
+#else
+	pdata->queue.min_queued_buffers = MIN_BUFFERS_NEEDED;
+#endif
 	pdata->queue.dev = dev;
 
 	rc = vb2_queue_init(&pdata->queue);
@@ -778,7 +2150,7 @@ static int psee_video_probe(struct platform_device *pdev)
 	pdata->vdev.device_caps = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_STREAMING | V4L2_CAP_READWRITE;
 	video_set_drvdata(&pdata->vdev, pdata);
 
-	rc = video_register_device(&pdata->vdev, VFL_TYPE_GRABBER, -1);
+	rc = video_register_device(&pdata->vdev, VFL_TYPE_VIDEO, -1);
 	if (rc) {
 		dev_err(dev, "Failed to register video device\n");
 		goto release_queue;
@@ -807,6 +2179,7 @@ unregister_v4l2:
 cleanup_media:
 	media_device_cleanup(&pdata->mdev);
 	mutex_destroy(&pdata->lock);
+	of_reserved_mem_device_release(dev);
 	return rc;
 }
 
@@ -822,7 +2195,9 @@ static int psee_video_remove(struct platform_device *pdev)
 	dma_release_channel(pdata->chan[OUT]);
 	v4l2_device_unregister(&pdata->v4l2_dev);
 	media_device_cleanup(&pdata->mdev);
+	mutex_destroy(&pdata->ring.lock);
 	mutex_destroy(&pdata->lock);
+	of_reserved_mem_device_release(dev);
 	return 0;
 }
 
@@ -861,6 +2236,12 @@ static void __exit psee_video_exit(void)
 module_init(psee_video_init);
 module_exit(psee_video_exit);
 
+/* before 6.0, kunit_test_suite() brings its own module_init() */
+#if defined(PSEE_VIDEO_KUNIT) && IS_ENABLED(CONFIG_KUNIT) && \
+	LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+#include "psee-video-test.c"
+#endif
+
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Prophesee");
 MODULE_DESCRIPTION("psee-video - media/v4l2 driver for Prophesee video IP");
@@ -0,0 +1,133 @@
+/* SPDX-License-Identifier: GPL-2.0-only WITH Linux-syscall-note */
+/*
+ * Prophesee FPGA CSI Rx driver - userspace interface
+ *
+ * Copyright (C) Prophesee S.A.
+ */
+
+#ifndef __PSEE_VIDEO_H__
+#define __PSEE_VIDEO_H__
+
+#include <linux/types.h>
+#include <linux/videodev2.h>
+
+/*
+ * Sent each time the driver recovered the capture from a DMA error without
+ * a stream restart. The payload is a struct psee_event_dma_recovery.
+ */
+#define V4L2_EVENT_PSEE_DMA_RECOVERY	(V4L2_EVENT_PRIVATE_START + 1)
+
+struct psee_event_dma_recovery {
+	__u32 count;		/* recoveries since the driver was loaded */
+	__u32 status;		/* dma_status that triggered the recovery */
+	__u64 gap_ns;		/* time from the fault to the DMA restart */
+	__u64 max_gap_ns;	/* longest gap seen so far */
+};
+
+/*
+ * Ring capture
+ *
+ * An alternative to the vb2 streaming I/O for consumers that cannot afford
+ * a QBUF/DQBUF round trip per buffer. PSEE_IOC_RING_START makes a cyclic DMA
+ * fill a single ring continuously, with no gap between buffers. The ring is
+ * mapped read-only at PSEE_RING_DATA_OFFSET, and a control page describing
+ * it at PSEE_RING_CTRL_OFFSET, both with the video node file descriptor.
+ *
+ * As with perf's ring buffer, data_head and data_tail are free running byte
+ * counters: the data available is [data_tail, data_head), found at offset
+ * (counter & (data_size - 1)) in the ring. A consumer reads data_head with
+ * acquire semantics, consumes the data, then stores data_tail with release
+ * semantics.
+ *
+ * The DMA never waits for the consumer. When data_head is published, the
+ * DMA is already writing the next period_size bytes, so only data at or
+ * above data_head + period_size - data_size is stable. Anything older is
+ * being overwritten and is accounted in lost at the next period. A consumer
+ * must therefore read data_head again after copying, and discard whatever
+ * it copied from below the new data_head + period_size - data_size.
+ *
+ * poll() reports the node readable whenever data_head > data_tail, and
+ * readable and hung up once the ring is stopped.
+ *
+ * read() on the node is a byte stream on top of the same ring, started
+ * with the default geometry on the first read() if the handle did not
+ * start one, and using data_tail as its cursor. It returns whatever is
+ * available, or sleeps until the next period_size bytes are written. When
+ * data was overwritten before being read, read() fails once with
+ * EOVERFLOW, skips to the oldest data still in the ring and carries on;
+ * the bytes skipped are accounted in lost. For read(), poll() reports the
+ * node readable as soon as read() would not block, and polling for input
+ * a handle that is neither capturing nor a tap starts the ring as the
+ * first read() would.
+ *
+ * splice() from the node is not supported and fails with EINVAL: the v4l2
+ * core has no splice hook, and the kernel no longer falls back to read()
+ * for it. Consumers that want no copy at all map the ring instead.
+ */
+#define PSEE_RING_CTRL_OFFSET	0x40000000
+#define PSEE_RING_DATA_OFFSET	0x50000000
+
+struct psee_ring_ctrl {
+	__u64 data_head;	/* bytes written by the DMA, driver owned */
+	__u64 data_tail;	/* bytes consumed, userspace owned */
+	__u64 data_size;	/* ring size, a power of two */
+	__u64 timestamp_ns;	/* CLOCK_MONOTONIC time of the last head update */
+	__u64 lost;		/* bytes overwritten before being consumed */
+	__u32 period_size;	/* data_head granularity */
+	__u32 reserved;
+};
+
+/*
+ * The ring is 16 MiB by default and at most 64 MiB. The period is 64 KiB
+ * by default, at least a page and at most half the ring. The control page
+ * must be mapped MAP_SHARED.
+ */
+struct psee_ring_config {
+	__u32 size;		/* ring size, power of two, 0 for the default */
+	__u32 period_size;	/* power of two, 0 for the default */
+};
+
+#define PSEE_IOC_RING_START	_IOWR('V', BASE_VIDIOC_PRIVATE + 0, struct psee_ring_config)
+#define PSEE_IOC_RING_STOP	_IO('V', BASE_VIDIOC_PRIVATE + 1)
+
+/*
+ * Fan-out
+ *
+ * Only the file handle owning the vb2 queue may QBUF/DQBUF, but any number
+ * of other handles may attach to it as read-only consumers ("taps") with
+ * PSEE_IOC_TAP_ATTACH. A tap finds the buffers with VIDIOC_QUERYBUF and
+ * mmaps them PROT_READ, then PSEE_IOC_TAP_GET hands it the next buffer
+ * completed by the DMA (blocking unless the handle is O_NONBLOCK, poll()
+ * reports it readable) and PSEE_IOC_TAP_PUT gives it back, with the index
+ * and sequence it was gotten with. As DQBUF, PSEE_IOC_TAP_GET fails with
+ * EINVAL while the capture is not streaming, including when a GET is
+ * blocked and the owner stops the stream; poll() then reports EPOLLERR.
+ *
+ * A buffer requeued by the owner only goes back to the DMA once every tap
+ * has put it. A tap holding more than max_lag buffers, pending or gotten,
+ * loses its oldest one: it is counted in dropped, and a later PUT of it
+ * fails with ENOENT, even once the same index was gotten again. max_lag is capped to the number of buffers minus the
+ * 4 the capture needs. A stalled tap never stops the capture either: when
+ * the owner requeues buffers still held while the DMA is about to run out
+ * of them, the oldest one is taken back from the taps, and counted in
+ * dropped the same way. Taps detach when their file handle is closed.
+ */
+struct psee_tap_attach {
+	__u32 max_lag;		/* 0 for the default */
+	__u32 reserved;
+};
+
+struct psee_tap_buffer {
+	__u32 index;
+	__u32 sequence;
+	__u32 bytesused;
+	__u32 reserved;
+	__u64 timestamp_ns;
+	__u64 dropped;		/* buffers this tap missed so far */
+};
+
+#define PSEE_IOC_TAP_ATTACH	_IOW('V', BASE_VIDIOC_PRIVATE + 2, struct psee_tap_attach)
+#define PSEE_IOC_TAP_GET	_IOR('V', BASE_VIDIOC_PRIVATE + 3, struct psee_tap_buffer)
+#define PSEE_IOC_TAP_PUT	_IOW('V', BASE_VIDIOC_PRIVATE + 4, struct psee_tap_buffer)
+
+#endif /* __PSEE_VIDEO_H__ */
@@ -0,0 +1,553 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * psee-record - zero-copy event stream recorder for psee-video
+ *
+ * Copyright (C) Prophesee S.A.
+ *
+ * The capture buffers are allocated by the recorder itself, from hugetlb
+ * memory so that each of them is physically contiguous, and queued to the
+ * driver as V4L2_MEMORY_USERPTR. The very same pages are registered with
+ * io_uring as fixed buffers: every dequeued buffer is written to disk with
+ * O_DIRECT straight from where the DMA left it, and is only queued back to
+ * the driver once its write has completed. No byte is ever copied by the CPU.
+ *
+ * Buffers mmapped from the driver (V4L2_MEMORY_MMAP, or DMABUF exported with
+ * VIDIOC_EXPBUF and mmapped) cannot be used for this: they are PFN mappings,
+ * which O_DIRECT is unable to pin.
+ *
+ * O_DIRECT requires block-aligned transfers, so each buffer is written
+ * rounded up to RECORD_ALIGN bytes. The padding stays in the data file; the
+ * index file written alongside (<output>.idx) holds, for each buffer, its
+ * sequence number, timestamp, offset in the data file and actual payload
+ * size, so that readers can both skip the padding and seek quickly.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <poll.h>
+
+#include <linux/videodev2.h>
+#include <liburing.h>
+
+#define RECORD_ALIGN		4096u
+#define RECORD_HUGEPAGE		(2u << 20)
+#define RECORD_DEFAULT_BUFFERS	32u
+#define RECORD_POLL_TAG		UINT64_MAX
+
+#define ALIGN_UP(x, a)		(((x) + (a) - 1) & ~((uint64_t)(a) - 1))
+
+/* On-disk index layout: one header followed by one record per buffer */
+struct psee_record_index_header {
+	char magic[8];			/* "PSEEIDX1" */
+	uint32_t align;			/* alignment of data file offsets */
+	uint32_t record_size;		/* sizeof(struct psee_record_index) */
+};
+
+struct psee_record_index {
+	uint32_t sequence;
+	uint32_t bytesused;
+	uint64_t timestamp_ns;
+	uint64_t offset;
+};
+
+/* O_DIRECT write of one buffer, resubmitted until all of it is on disk */
+struct pending_write {
+	uint64_t offset;
+	uint32_t len;
+	uint32_t done;
+};
+
+struct recorder {
+	int video_fd;
+	int data_fd;
+	FILE *index;
+	struct io_uring ring;
+
+	unsigned int nbufs;
+	size_t buf_size;
+	void *mem;
+	size_t mem_size;
+	struct pending_write *writes;
+
+	unsigned int writes_in_flight;
+	bool poll_armed;
+	bool streaming;
+
+	uint64_t offset;
+	uint64_t bytes;
+	uint64_t buffers;
+	uint64_t errors;
+	uint64_t dropped;
+	uint32_t next_sequence;
+	bool have_sequence;
+};
+
+static volatile sig_atomic_t stop_requested;
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop_requested = 1;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-d device] [-n buffers] [-t seconds] -o output\n"
+		"  -d  capture device (default /dev/video0)\n"
+		"  -n  number of capture buffers kept in flight (default %u)\n"
+		"  -t  stop after this many seconds (default: until SIGINT)\n"
+		"  -o  raw data output file, the index goes to <output>.idx\n",
+		name, RECORD_DEFAULT_BUFFERS);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int alloc_buffers(struct recorder *r)
+{
+	r->mem_size = ALIGN_UP((uint64_t)r->nbufs * r->buf_size, RECORD_HUGEPAGE);
+	r->mem = mmap(NULL, r->mem_size, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE,
+		      -1, 0);
+	if (r->mem != MAP_FAILED)
+		return 0;
+
+	/*
+	 * Without hugetlb pages the buffers are only DMA contiguous behind an
+	 * IOMMU: let the driver decide whether it can use them.
+	 */
+	fprintf(stderr, "warning: no hugetlb pages (see /proc/sys/vm/nr_hugepages), "
+		"falling back to regular pages\n");
+	r->mem = mmap(NULL, r->mem_size, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (r->mem == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	return 0;
+}
+
+static void *buffer_addr(struct recorder *r, unsigned int index)
+{
+	return (char *)r->mem + (size_t)index * r->buf_size;
+}
+
+static int queue_buffer(struct recorder *r, unsigned int index)
+{
+	struct v4l2_buffer buf = {
+		.index = index,
+		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+		.memory = V4L2_MEMORY_USERPTR,
+		.m.userptr = (unsigned long)buffer_addr(r, index),
+		.length = r->buf_size,
+	};
+
+	if (ioctl(r->video_fd, VIDIOC_QBUF, &buf) < 0) {
+		perror("VIDIOC_QBUF");
+		return -1;
+	}
+	return 0;
+}
+
+static int setup_capture(struct recorder *r, const char *device)
+{
+	struct v4l2_format fmt = { .type = V4L2_BUF_TYPE_VIDEO_CAPTURE };
+	struct v4l2_requestbuffers req = {
+		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+		.memory = V4L2_MEMORY_USERPTR,
+	};
+
+	r->video_fd = open(device, O_RDWR | O_NONBLOCK);
+	if (r->video_fd < 0) {
+		perror(device);
+		return -1;
+	}
+
+	if (ioctl(r->video_fd, VIDIOC_G_FMT, &fmt) < 0) {
+		perror("VIDIOC_G_FMT");
+		return -1;
+	}
+	r->buf_size = ALIGN_UP(fmt.fmt.pix.sizeimage, RECORD_ALIGN);
+
+	req.count = r->nbufs;
+	if (ioctl(r->video_fd, VIDIOC_REQBUFS, &req) < 0) {
+		perror("VIDIOC_REQBUFS");
+		return -1;
+	}
+	/*
+	 * The driver may give fewer buffers than asked, or more when asked
+	 * for less than it needs to start the DMA: all of them are queued.
+	 */
+	if (req.count != r->nbufs) {
+		fprintf(stderr, "driver allocated %u buffers\n", req.count);
+		r->nbufs = req.count;
+	}
+
+	return alloc_buffers(r);
+}
+
+static int setup_output(struct recorder *r, const char *output)
+{
+	struct psee_record_index_header hdr = {
+		.magic = "PSEEIDX1",
+		.align = RECORD_ALIGN,
+		.record_size = sizeof(struct psee_record_index),
+	};
+	char *index_name;
+
+	r->data_fd = open(output, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+	if (r->data_fd < 0) {
+		perror(output);
+		return -1;
+	}
+
+	if (asprintf(&index_name, "%s.idx", output) < 0)
+		return -1;
+	r->index = fopen(index_name, "w");
+	if (!r->index) {
+		perror(index_name);
+		free(index_name);
+		return -1;
+	}
+	free(index_name);
+
+	if (fwrite(&hdr, sizeof(hdr), 1, r->index) != 1) {
+		perror("index header");
+		return -1;
+	}
+	return 0;
+}
+
+static int setup_ring(struct recorder *r)
+{
+	struct iovec *iovs;
+	unsigned int i;
+	int ret;
+
+	/* one write per buffer at most, plus the poll on the video node */
+	ret = io_uring_queue_init(r->nbufs + 1, &r->ring, 0);
+	if (ret < 0) {
+		fprintf(stderr, "io_uring_queue_init: %s\n", strerror(-ret));
+		return -1;
+	}
+
+	r->writes = calloc(r->nbufs, sizeof(*r->writes));
+	iovs = calloc(r->nbufs, sizeof(*iovs));
+	if (!r->writes || !iovs) {
+		free(iovs);
+		return -1;
+	}
+	for (i = 0; i < r->nbufs; i++) {
+		iovs[i].iov_base = buffer_addr(r, i);
+		iovs[i].iov_len = r->buf_size;
+	}
+
+	/* pin the buffers once, instead of on every write */
+	ret = io_uring_register_buffers(&r->ring, iovs, r->nbufs);
+	free(iovs);
+	if (ret < 0) {
+		fprintf(stderr, "io_uring_register_buffers: %s\n", strerror(-ret));
+		return -1;
+	}
+
+	ret = io_uring_register_files(&r->ring, &r->data_fd, 1);
+	if (ret < 0) {
+		fprintf(stderr, "io_uring_register_files: %s\n", strerror(-ret));
+		return -1;
+	}
+	return 0;
+}
+
+static struct io_uring_sqe *get_sqe(struct recorder *r)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&r->ring);
+
+	if (!sqe) {
+		io_uring_submit(&r->ring);
+		sqe = io_uring_get_sqe(&r->ring);
+	}
+	return sqe;
+}
+
+static int arm_poll(struct recorder *r)
+{
+	struct io_uring_sqe *sqe = get_sqe(r);
+
+	if (!sqe)
+		return -1;
+	io_uring_prep_poll_add(sqe, r->video_fd, POLLIN);
+	io_uring_sqe_set_data64(sqe, RECORD_POLL_TAG);
+	r->poll_armed = true;
+	return 0;
+}
+
+/* Submit what is left to write of a buffer */
+static int submit_write(struct recorder *r, unsigned int index)
+{
+	struct pending_write *w = &r->writes[index];
+	struct io_uring_sqe *sqe = get_sqe(r);
+
+	if (!sqe)
+		return -1;
+	io_uring_prep_write_fixed(sqe, 0, (char *)buffer_addr(r, index) + w->done,
+				  w->len - w->done, w->offset + w->done, index);
+	sqe->flags |= IOSQE_FIXED_FILE;
+	io_uring_sqe_set_data64(sqe, index);
+	return 0;
+}
+
+static int write_buffer(struct recorder *r, const struct v4l2_buffer *buf)
+{
+	struct pending_write *w = &r->writes[buf->index];
+	struct psee_record_index rec;
+	uint32_t len = ALIGN_UP(buf->bytesused, RECORD_ALIGN);
+
+	if (buf->flags & V4L2_BUF_FLAG_ERROR)
+		r->errors++;
+
+	/* a buffer the driver could not hand to the DMA has no sequence */
+	if (!(buf->flags & V4L2_BUF_FLAG_ERROR) || buf->bytesused) {
+		if (r->have_sequence && buf->sequence != r->next_sequence)
+			r->dropped += buf->sequence - r->next_sequence;
+		r->next_sequence = buf->sequence + 1;
+		r->have_sequence = true;
+	}
+
+	/* nothing to write: hand the buffer back to the driver right away */
+	if (!buf->bytesused)
+		return queue_buffer(r, buf->index);
+
+	w->offset = r->offset;
+	w->len = len;
+	w->done = 0;
+	if (submit_write(r, buf->index))
+		return -1;
+	r->writes_in_flight++;
+
+	rec.sequence = buf->sequence;
+	rec.bytesused = buf->bytesused;
+	rec.timestamp_ns = (uint64_t)buf->timestamp.tv_sec * 1000000000ull +
+			   (uint64_t)buf->timestamp.tv_usec * 1000ull;
+	rec.offset = r->offset;
+	if (fwrite(&rec, sizeof(rec), 1, r->index) != 1) {
+		perror("index");
+		return -1;
+	}
+
+	r->offset += len;
+	r->bytes += buf->bytesused;
+	r->buffers++;
+	return 0;
+}
+
+static int dequeue_buffers(struct recorder *r)
+{
+	struct v4l2_buffer buf;
+
+	for (;;) {
+		memset(&buf, 0, sizeof(buf));
+		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buf.memory = V4L2_MEMORY_USERPTR;
+
+		if (ioctl(r->video_fd, VIDIOC_DQBUF, &buf) < 0) {
+			if (errno == EAGAIN)
+				return 0;
+			perror("VIDIOC_DQBUF");
+			return -1;
+		}
+		if (write_buffer(r, &buf))
+			return -1;
+	}
+}
+
+static int handle_completion(struct recorder *r, struct io_uring_cqe *cqe)
+{
+	uint64_t tag = io_uring_cqe_get_data64(cqe);
+	struct pending_write *w;
+
+	if (tag == RECORD_POLL_TAG) {
+		r->poll_armed = false;
+		if (cqe->res < 0 && cqe->res != -EINTR) {
+			fprintf(stderr, "poll: %s\n", strerror(-cqe->res));
+			return -1;
+		}
+		return r->streaming ? dequeue_buffers(r) : 0;
+	}
+
+	if (cqe->res < 0) {
+		fprintf(stderr, "write: %s\n", strerror(-cqe->res));
+		return -1;
+	}
+
+	/*
+	 * A short write (e.g. interrupted, or the filesystem splitting it) is
+	 * resumed where it stopped: the index already points at this data.
+	 * No progress at all means the disk is full or failing.
+	 */
+	w = &r->writes[tag];
+	if (!cqe->res) {
+		fprintf(stderr, "write: no progress at offset %llu\n",
+			(unsigned long long)(w->offset + w->done));
+		return -1;
+	}
+	w->done += cqe->res;
+	if (w->done < w->len)
+		return submit_write(r, tag);
+
+	r->writes_in_flight--;
+
+	/* the data is on its way to the disk, the DMA may now overwrite it */
+	return r->streaming ? queue_buffer(r, tag) : 0;
+}
+
+static int record(struct recorder *r, unsigned int seconds)
+{
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	uint64_t deadline = seconds ? now_ns() + seconds * 1000000000ull : 0;
+	struct __kernel_timespec timeout;
+	struct io_uring_cqe *cqe;
+	unsigned int head, seen;
+	uint64_t left;
+	unsigned int i;
+	int ret = 0;
+
+	for (i = 0; i < r->nbufs; i++)
+		if (queue_buffer(r, i))
+			return -1;
+
+	if (ioctl(r->video_fd, VIDIOC_STREAMON, &type) < 0) {
+		perror("VIDIOC_STREAMON");
+		return -1;
+	}
+	r->streaming = true;
+
+	while (r->streaming || r->writes_in_flight || r->poll_armed) {
+		if (r->streaming && (stop_requested ||
+				     (deadline && now_ns() >= deadline))) {
+			/* buffers still queued to the driver are simply dropped */
+			if (ioctl(r->video_fd, VIDIOC_STREAMOFF, &type) < 0)
+				perror("VIDIOC_STREAMOFF");
+			r->streaming = false;
+		}
+
+		if (r->streaming && !r->poll_armed && arm_poll(r))
+			return -1;
+
+		/*
+		 * Wake up at the deadline even if the sensor sends nothing,
+		 * once streaming stopped only the pending writes are awaited.
+		 */
+		if (r->streaming && deadline) {
+			left = now_ns();
+			left = deadline > left ? deadline - left : 0;
+			timeout.tv_sec = left / 1000000000ull;
+			timeout.tv_nsec = left % 1000000000ull;
+			ret = io_uring_submit_and_wait_timeout(&r->ring, &cqe, 1,
+							       &timeout, NULL);
+		} else {
+			ret = io_uring_submit_and_wait(&r->ring, 1);
+		}
+		if (ret < 0 && ret != -EINTR && ret != -ETIME) {
+			fprintf(stderr, "io_uring_submit_and_wait: %s\n",
+				strerror(-ret));
+			return -1;
+		}
+
+		seen = 0;
+		io_uring_for_each_cqe(&r->ring, head, cqe) {
+			seen++;
+			if (handle_completion(r, cqe)) {
+				io_uring_cq_advance(&r->ring, seen);
+				return -1;
+			}
+		}
+		io_uring_cq_advance(&r->ring, seen);
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct recorder r = {
+		.video_fd = -1,
+		.data_fd = -1,
+		.nbufs = RECORD_DEFAULT_BUFFERS,
+	};
+	const char *device = "/dev/video0";
+	const char *output = NULL;
+	unsigned int seconds = 0;
+	uint64_t start, elapsed;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "d:n:t:o:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 'n':
+			r.nbufs = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			seconds = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (!output || !r.nbufs) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	if (setup_capture(&r, device) || setup_output(&r, output) ||
+	    setup_ring(&r))
+		return 1;
+
+	start = now_ns();
+	ret = record(&r, seconds);
+	elapsed = now_ns() - start;
+
+	io_uring_queue_exit(&r.ring);
+	free(r.writes);
+	if (fsync(r.data_fd) < 0)
+		perror("fsync");
+	close(r.data_fd);
+	if (fclose(r.index))
+		perror("index");
+	close(r.video_fd);
+
+	fprintf(stderr, "%llu buffers, %llu bytes in %.3f s (%.1f MB/s), "
+		"%llu dropped, %llu in error\n",
+		(unsigned long long)r.buffers, (unsigned long long)r.bytes,
+		elapsed / 1e9, elapsed ? r.bytes * 1e3 / elapsed : 0.0,
+		(unsigned long long)r.dropped, (unsigned long long)r.errors);
+
+	return ret ? 1 : 0;
+}